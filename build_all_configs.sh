@@ -5,23 +5,43 @@
 
 set -e
 
+PROFILE_IMAGE_ARGS="-c spiffs/src --direct-layout -s 0x100000 -p 512 -b 0x2000"
+
+# Compares the image which the generic binary created with --format-profile
+# with the one the binary just built for that configuration creates
+check_profile() {
+    if [ -z "$SKIP_TESTS" ]; then
+        ./mkspiffs $PROFILE_IMAGE_ARGS out.profile-built-in >/dev/null
+        cmp out.profile-$1 out.profile-built-in
+        rm -f out.profile-$1 out.profile-built-in
+    fi
+}
+
 # Generic (default options)
 make dist
+if [ -z "$SKIP_TESTS" ]; then
+    for profile in arduino-esp8266 arduino-esp32 esp-idf; do
+        ./mkspiffs $PROFILE_IMAGE_ARGS --format-profile $profile out.profile-$profile >/dev/null
+    done
+fi
 
 # Arduino ESP8266
 make clean
 make dist BUILD_CONFIG_NAME="-arduino-esp8266" \
     CPPFLAGS="-DSPIFFS_USE_MAGIC_LENGTH=0 -DSPIFFS_ALIGNED_OBJECT_INDEX_TABLES=1"
+check_profile arduino-esp8266
 
 # Build configuration for arduino-esp32
 make clean
 make dist BUILD_CONFIG_NAME="-arduino-esp32" \
     CPPFLAGS="-DSPIFFS_OBJ_META_LEN=4"
+check_profile arduino-esp32
 
 # Build configuration for ESP-IDF (esp32)
 make clean
 make dist BUILD_CONFIG_NAME="-esp-idf" \
     CPPFLAGS="-DSPIFFS_OBJ_META_LEN=4"
+check_profile esp-idf
 
 
 
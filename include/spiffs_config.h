@@ -123,8 +123,9 @@ typedef uint8_t u8_t;
 #endif
 
 // Enable/disable statistics on caching. Debug/test purpose only.
+// Enabled for --stats; the counters live in RAM and do not change the image.
 #ifndef  SPIFFS_CACHE_STATS
-#define SPIFFS_CACHE_STATS              0
+#define SPIFFS_CACHE_STATS              1
 #endif
 #endif
 
@@ -140,8 +141,9 @@ typedef uint8_t u8_t;
 #endif
 
 // Enable/disable statistics on gc. Debug/test purpose only.
+// Enabled for --stats; the counters live in RAM and do not change the image.
 #ifndef SPIFFS_GC_STATS
-#define SPIFFS_GC_STATS                 0
+#define SPIFFS_GC_STATS                 1
 #endif
 
 // Garbage collecting examines all pages in a block which and sums up
@@ -226,8 +228,9 @@ typedef uint8_t u8_t;
 #endif
 
 // Enable this if you want the HAL callbacks to be called with the spiffs struct
+// mkspiffs uses the spiffs struct to find the image a callback refers to.
 #ifndef SPIFFS_HAL_CALLBACK_EXTRA
-#define SPIFFS_HAL_CALLBACK_EXTRA               0
+#define SPIFFS_HAL_CALLBACK_EXTRA               1
 #endif
 
 // Enable this if you want to add an integer offset to all file handles
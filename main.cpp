@@ -9,6 +9,9 @@
 
 #include <iostream>
 #include "spiffs.h"
+extern "C" {
+#include "spiffs_nucleus.h"
+}
 #include <vector>
 #include <dirent.h>
 #include <sys/types.h>
@@ -18,32 +21,193 @@
 #include <string>
 #include <memory>
 #include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 #include "tclap/CmdLine.h"
 #include "tclap/UnlabeledValueArg.h"
+#include "sha256.h"
+
+// MinGW's win32 threads model has no std::thread, std::mutex,
+// std::condition_variable or std::call_once before GCC 13. Such builds do
+// all work on the calling thread.
+#if defined(__GLIBCXX__) && !defined(_GLIBCXX_HAS_GTHREADS)
+#define MKSPIFFS_THREADS 0
+#else
+#define MKSPIFFS_THREADS 1
+#endif
+
+// SIMD code paths for x86 hosts. -DMKSPIFFS_SCALAR leaves them out, so that
+// `make bench` can compare them with the plain loops.
+#if defined(__AVX2__) && !defined(MKSPIFFS_SCALAR)
+#define MKSPIFFS_AVX2 1
+#define MKSPIFFS_SSE2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(MKSPIFFS_SCALAR)
+#define MKSPIFFS_AVX2 0
+#define MKSPIFFS_SSE2 1
+#include <emmintrin.h>
+#else
+#define MKSPIFFS_AVX2 0
+#define MKSPIFFS_SSE2 0
+#endif
 
 #ifdef _WIN32
 #include <direct.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __APPLE__
+#include <Availability.h>
+#endif
+
+// fdopendir, openat and fstatat are missing on Windows and before macOS
+// 10.10, which is older than the deployment target of the osx build. There,
+// source directories are walked by path.
+#if defined(_WIN32) || (defined(__APPLE__) && __MAC_OS_X_VERSION_MIN_REQUIRED < 101000)
+#define MKSPIFFS_AT_FUNCTIONS 0
+#else
+#define MKSPIFFS_AT_FUNCTIONS 1
+#endif
+
+static size_t getFileSize(FILE* fp);
+
+// Flash contents, either held in a buffer or mapped from an image file.
+// Mapped images are private and read-only until SPIFFS writes to them, at
+// which point the mapping becomes copy-on-write; the file itself is never
+// modified.
+class FlashMemory
+{
+public:
+    ~FlashMemory()
+    {
+        release();
+    }
+
+    void create(size_t size)
+    {
+        release();
+        m_buffer.assign(size, 0xff);
+        m_data = m_buffer.empty() ? NULL : &m_buffer[0];
+        m_size = size;
+    }
+
+    void load(FILE* fp, size_t size)
+    {
+        release();
+#ifndef _WIN32
+        // Only the part of the image which is backed by the file can be
+        // mapped, so images smaller than the requested size are read instead.
+        struct stat st;
+        if (fstat(fileno(fp), &st) == 0 && (size_t) st.st_size >= size && size > 0) {
+            void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if (addr != MAP_FAILED) {
+                m_data = (uint8_t*) addr;
+                m_size = size;
+                m_mapped = true;
+                m_readOnly = true;
+                return;
+            }
+        }
+#endif
+        create(size);
+        fseek(fp, 0L, SEEK_SET);
+        fread(m_data, 1, size, fp);
+    }
+
+    uint8_t* data()
+    {
+        return m_data;
+    }
+
+    uint8_t* writeData()
+    {
+#ifndef _WIN32
+        if (m_readOnly) {
+            if (mprotect(m_data, m_size, PROT_READ | PROT_WRITE) != 0) {
+                // fall back to a private copy of the image
+                std::vector<uint8_t> copy(m_data, m_data + m_size);
+                release();
+                m_buffer.swap(copy);
+                m_data = &m_buffer[0];
+                m_size = m_buffer.size();
+            }
+            m_readOnly = false;
+        }
+#endif
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    void release()
+    {
+#ifndef _WIN32
+        if (m_mapped) {
+            munmap(m_data, m_size);
+        }
 #endif
+        m_buffer.clear();
+        m_data = NULL;
+        m_size = 0;
+        m_mapped = false;
+        m_readOnly = false;
+    }
 
-static std::vector<uint8_t> s_flashmem;
+private:
+    std::vector<uint8_t> m_buffer;
+    uint8_t* m_data = NULL;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    bool m_readOnly = false;
+};
 
 static std::string s_dirName;
 static std::string s_imageName;
+static std::string s_manifestName;
+static std::string s_traceName;
+static std::string s_updateImageName;
+static std::string s_compareImageName;
 static int s_imageSize;
 static int s_pageSize;
 static int s_blockSize;
 
-enum Action { ACTION_NONE, ACTION_PACK, ACTION_UNPACK, ACTION_LIST, ACTION_VISUALIZE };
+enum Action { ACTION_NONE, ACTION_PACK, ACTION_UNPACK, ACTION_LIST, ACTION_VISUALIZE, ACTION_MANIFEST, ACTION_PLAN, ACTION_OPTIMIZE_GEOMETRY, ACTION_REPLAY };
 static Action s_action = ACTION_NONE;
 
-static spiffs s_fs;
-
-static std::vector<uint8_t> s_spiffsWorkBuf;
-static std::vector<uint8_t> s_spiffsFds;
-static std::vector<uint8_t> s_spiffsCache;
+static const int physicalFlashEraseBlockSize = 4096;
+static const int physicalFlashProgramPageSize = 256;
 
 static int s_debugLevel = 0;
 static bool s_addAllFiles;
+static int s_chunkSize;
+static bool s_directLayout;
+static bool s_stablePlacement;
+static bool s_stream;
+static int s_blockSlack;
+static bool s_zeroCopy;
+static bool s_reproducible;
+static int s_readahead;
+static bool s_autoSize;
+static int s_freeMargin;
+static std::string s_statsFormat;
+static bool s_wear;
+static bool s_strictNor;
+static int s_jobCount;
+static bool s_jobCountSet;
 
 // Unless -a flag is given, these files/directories will not be included into the image
 static const char* ignored_file_names[] = {
@@ -53,388 +217,2218 @@ static const char* ignored_file_names[] = {
     ".gitmodules"
 };
 
-static s32_t api_spiffs_read(u32_t addr, u32_t size, u8_t *dst)
-{
-    memcpy(dst, &s_flashmem[0] + addr, size);
-    return SPIFFS_OK;
-}
+// Source file contents shared between the jobs of a manifest build, so that
+// each source file is read from disk only once.
+typedef std::shared_ptr<const std::vector<uint8_t>> SourceContents;
 
-static s32_t api_spiffs_write(u32_t addr, u32_t size, u8_t *src)
+// returns NULL if the file can't be read
+static SourceContents readSourceFile(const std::string& path)
 {
-    memcpy(&s_flashmem[0] + addr, src, size);
-    return SPIFFS_OK;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return SourceContents();
+    }
+    std::shared_ptr<std::vector<uint8_t>> contents = std::make_shared<std::vector<uint8_t>>(getFileSize(fp));
+    bool ok = contents->empty() || fread(&(*contents)[0], 1, contents->size(), fp) == contents->size();
+    fclose(fp);
+    return ok ? contents : SourceContents();
 }
 
-static s32_t api_spiffs_erase(u32_t addr, u32_t size)
+#if MKSPIFFS_THREADS
+class SourceCache
 {
-    memset(&s_flashmem[0] + addr, 0xff, size);
-    return SPIFFS_OK;
-}
-
-static int checkArgs();
-static size_t getFileSize(FILE* fp);
+public:
+    typedef SourceContents Contents;
 
+    // returns NULL if the file can't be read
+    Contents get(const std::string& path)
+    {
+        std::shared_ptr<Entry> entry;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::shared_ptr<Entry>& slot = m_entries[path];
+            if (!slot) {
+                slot = std::make_shared<Entry>();
+            }
+            entry = slot;
+        }
+        std::call_once(entry->once, [&entry, &path]() {
+            entry->contents = readSourceFile(path);
+        });
+        return entry->contents;
+    }
 
-//implementation
+private:
+    struct Entry {
+        std::once_flag once;
+        Contents contents;
+    };
 
-int spiffsTryMount()
+    std::mutex m_mutex;
+    std::map<std::string, std::shared_ptr<Entry>> m_entries;
+};
+#else
+// Without threads, manifest jobs are built one after another.
+class SourceCache
 {
-    spiffs_config cfg = {0};
-
-    cfg.phys_addr = 0x0000;
-    cfg.phys_size = (u32_t) s_flashmem.size();
-
-    cfg.phys_erase_block = s_blockSize;
-    cfg.log_block_size = s_blockSize;
-    cfg.log_page_size = s_pageSize;
-
-    cfg.hal_read_f = api_spiffs_read;
-    cfg.hal_write_f = api_spiffs_write;
-    cfg.hal_erase_f = api_spiffs_erase;
-
-    const int maxOpenFiles = 4;
-    s_spiffsWorkBuf.resize(s_pageSize * 2);
-    s_spiffsFds.resize(32 * maxOpenFiles);
-    s_spiffsCache.resize((32 + s_pageSize) * maxOpenFiles);
-
-    return SPIFFS_mount(&s_fs, &cfg,
-                        &s_spiffsWorkBuf[0],
-                        &s_spiffsFds[0], s_spiffsFds.size(),
-                        &s_spiffsCache[0], s_spiffsCache.size(),
-                        NULL);
-}
+public:
+    typedef SourceContents Contents;
 
-bool spiffsMount(bool printError = true)
-{
-    if (SPIFFS_mounted(&s_fs)) {
-        return true;
-    }
-    int res = spiffsTryMount();
-    if (res != SPIFFS_OK) {
-        if (printError) {
-            std::cerr << "SPIFFS mount failed with error: " << res << std::endl;
+    // returns NULL if the file can't be read
+    Contents get(const std::string& path)
+    {
+        auto it = m_entries.find(path);
+        if (it == m_entries.end()) {
+            it = m_entries.insert(std::make_pair(path, readSourceFile(path))).first;
         }
-        return false;
+        return it->second;
     }
-    return true;
-}
 
-bool spiffsFormat()
-{
-    spiffsMount(false);
-    SPIFFS_unmount(&s_fs);
-    int formated = SPIFFS_format(&s_fs);
-    if (formated != SPIFFS_OK) {
-        return false;
-    }
-    return (spiffsTryMount() == SPIFFS_OK);
-}
+private:
+    std::map<std::string, Contents> m_entries;
+};
+#endif
 
-void spiffsUnmount()
-{
-    if (SPIFFS_mounted(&s_fs)) {
-        SPIFFS_unmount(&s_fs);
-    }
-}
+// Options of the on-flash format which SPIFFS fixes at compile time. The
+// direct layout engine takes them at run time, so that one binary can create
+// images for all of the configurations in build_all_configs.sh.
+struct FormatProfile {
+    const char* name;
+    int metaLen;
+    bool useMagic;
+    bool useMagicLength;
+    bool alignedObjectIndexTables;
+};
 
-int addFile(char* name, const char* path)
-{
-    FILE* src = fopen(path, "rb");
-    if (!src) {
-        std::cerr << "error: failed to open " << path << " for reading" << std::endl;
-        return 1;
-    }
+#if SPIFFS_USE_MAGIC
+#define BUILTIN_USE_MAGIC_LENGTH SPIFFS_USE_MAGIC_LENGTH
+#else
+#define BUILTIN_USE_MAGIC_LENGTH 0
+#endif
 
-    spiffs_file dst = SPIFFS_open(&s_fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
+// configuration this binary was built with
+static const FormatProfile s_builtinProfile = {
+    "built-in", SPIFFS_OBJ_META_LEN, SPIFFS_USE_MAGIC, BUILTIN_USE_MAGIC_LENGTH, SPIFFS_ALIGNED_OBJECT_INDEX_TABLES
+};
 
-    // read file size
-    size_t size = getFileSize(src);
+#undef BUILTIN_USE_MAGIC_LENGTH
 
-    if (s_debugLevel > 0) {
-        std::cout << "file size: " << size << std::endl;
-    }
+static const FormatProfile s_formatProfiles[] = {
+    { "generic",         0, true, true,  false },
+    { "arduino-esp8266", 0, true, false, true  },
+    { "arduino-esp32",   4, true, true,  false },
+    { "esp-idf",         4, true, true,  false },
+};
 
-    size_t left = size;
-    uint8_t data_byte;
-    while (left > 0) {
-        if (1 != fread(&data_byte, 1, 1, src)) {
-            std::cerr << "fread error!" << std::endl;
+static const FormatProfile* s_formatProfile = &s_builtinProfile;
 
-            fclose(src);
-            SPIFFS_close(&s_fs, dst);
-            return 1;
-        }
-        int res = SPIFFS_write(&s_fs, dst, &data_byte, 1);
-        if (res < 0) {
-            std::cerr << "SPIFFS_write error(" << s_fs.err_code << "): ";
+// Flash timings used to estimate how long the flash operations of an action
+// would take on a device. Programs are counted per 256 byte flash page and
+// erases per 4 KB sector; reads assume a 40 MHz quad I/O bus.
+struct FlashTiming {
+    const char* name;
+    double readNsPerByte;
+    double programUsPerPage;
+    double eraseMsPerSector;
+};
 
-            if (s_fs.err_code == SPIFFS_ERR_FULL) {
-                std::cerr << "File system is full." << std::endl;
-            } else {
-                std::cerr << "unknown";
-            }
-            std::cerr << std::endl;
+// typical page program and sector erase times from datasheets of 32 Mbit parts
+static const FlashTiming s_flashTimings[] = {
+    { "w25q",  50, 400, 45 },
+    { "gd25q", 50, 600, 50 },
+    { "mx25l", 50, 500, 40 },
+};
 
-            if (s_debugLevel > 0) {
-                std::cout << "data left: " << left << std::endl;
-            }
+// --flash-timing given as <read_ns_per_byte>,<program_us_per_page>,<erase_ms_per_sector>
+static FlashTiming s_customFlashTiming = { "custom", 0, 0, 0 };
+static const FlashTiming* s_flashTiming = NULL;
+
+// Sizes of on-flash structures of an image, see layoutGeometry()
+struct LayoutGeometry {
+    u32_t pageSize;
+    u32_t blockSize;
+    u32_t blockCount;
+    u32_t pagesPerBlock;
+    u32_t lookupPages;
+    u32_t lookupEntries;
+    u32_t dataPageSize;
+    u32_t ixHeaderSize;
+    u32_t hdrIxLen;
+    u32_t ixLen;
+};
 
-            fclose(src);
-            SPIFFS_close(&s_fs, dst);
-            return 1;
-        }
-        left -= 1;
-    }
+// File placed by the direct layout engine
+struct LayoutFile {
+    std::string name;
+    u32_t size;
+};
 
-    SPIFFS_close(&s_fs, dst);
-    fclose(src);
+// Object of a mounted image, found by indexImage
+struct IndexedObject {
+    // same as SPIFFS_readdir would return
+    spiffs_dirent ent;
+    bool hasHeader = false;
+    // object index pages by span index, ~0 where missing
+    std::vector<spiffs_page_ix> ixPages;
+};
 
-    return 0;
-}
+// File waiting to be placed with --stable-placement
+struct LayoutSource {
+    std::string name;
+    std::string path;
+    u32_t hash;
+    spiffs_block_ix home;
+};
+
+typedef std::chrono::steady_clock::duration Duration;
+
+// Wall time of the phases of an action and counters of flash accesses,
+// printed with --stats
+struct Stats {
+    Duration traversal = Duration::zero();
+    Duration sourceRead = Duration::zero();
+    Duration write = Duration::zero();
+    Duration format = Duration::zero();
+    Duration mount = Duration::zero();
+    Duration imageIo = Duration::zero();
+
+    uint64_t halReads = 0;
+    uint64_t halReadBytes = 0;
+    uint64_t halWrites = 0;
+    uint64_t halWriteBytes = 0;
+    uint64_t halErases = 0;
+    uint64_t halEraseBytes = 0;
+
+    // collected from the spiffs struct before each unmount
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t gcRuns = 0;
+
+    // estimated device time of the HAL calls above, with --flash-timing
+    double flashReadUs = 0;
+    double flashProgramUs = 0;
+    double flashEraseUs = 0;
+    double flashMountUs = 0;
+};
 
-int addFiles(const char* dirname, const char* subPath)
+static double flashTimeUs(const Stats& st)
 {
-    DIR *dir;
-    struct dirent *ent;
-    bool error = false;
-    std::string dirPath = dirname;
-    dirPath += subPath;
+    return st.flashReadUs + st.flashProgramUs + st.flashEraseUs;
+}
 
-    // Open directory
-    if ((dir = opendir (dirPath.c_str())) != NULL) {
+// Simulated flash wear, with --wear: erases of each block and programs of
+// each page since the image was created or loaded, and writes which would
+// have to change bits from 0 to 1, which NOR flash can only do by erasing
+struct WearStats {
+    std::vector<u32_t> blockErases;
+    std::vector<u32_t> pagePrograms;
+    uint64_t illegalWrites = 0;
+    uint64_t illegalBits = 0;
+    u32_t firstIllegalAddr = 0;
+};
 
-        // Read files from directory.
-        while ((ent = readdir (dir)) != NULL) {
+// Adds the time until it goes out of scope to a phase
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(Duration& phase) : m_phase(phase), m_start(std::chrono::steady_clock::now())
+    {
+    }
 
-            // Ignore dir itself.
-            if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) {
-                continue;
-            }
+    ~PhaseTimer()
+    {
+        m_phase += std::chrono::steady_clock::now() - m_start;
+    }
 
-            if (!s_addAllFiles) {
-                bool skip = false;
-                size_t ignored_file_names_count = sizeof(ignored_file_names) / sizeof(ignored_file_names[0]);
-                for (size_t i = 0; i < ignored_file_names_count; ++i) {
-                    if (strcmp(ent->d_name, ignored_file_names[i]) == 0) {
-                        std::cerr << "skipping " << ent->d_name << std::endl;
-                        skip = true;
-                        break;
-                    }
-                }
-                if (skip) {
-                    continue;
-                }
-            }
+private:
+    Duration& m_phase;
+    std::chrono::steady_clock::time_point m_start;
+};
 
-            std::string fullpath = dirPath;
-            fullpath += ent->d_name;
-            struct stat path_stat;
-            stat (fullpath.c_str(), &path_stat);
+// State of one image being built or read. The command line describes a
+// single image, while a manifest build runs one context per job, each on
+// its own thread.
+struct ImageContext {
+    // must stay the first member: HAL callbacks only get the spiffs pointer
+    spiffs fs;
+
+    FlashMemory flashmem;
+    std::vector<uint8_t> workBuf;
+    std::vector<uint8_t> fds;
+    std::vector<uint8_t> cache;
+    std::vector<uint8_t> unpackBuf;
+
+    std::string dirName;
+    std::string imageName;
+    int imageSize = 0;
+    int pageSize = 0;
+    int blockSize = 0;
+
+    // don't print names of added files
+    bool quiet = false;
+    SourceCache* sourceCache = NULL;
+
+    // contents of the file being added, if read ahead by SourcePrefetcher
+    SourceContents prefetched;
+    std::string prefetchedPath;
+
+    // direct layout state
+    const FormatProfile* profile = &s_builtinProfile;
+    LayoutGeometry geometry;
+    std::vector<LayoutFile> layoutFiles;
+    std::vector<LayoutSource> layoutSources;
+    std::vector<u32_t> layoutFill;
+    spiffs_block_ix layoutBlock = 0;
+    spiffs_obj_id layoutObjId = 0;
+
+    // --stream state: blocks which are being filled, while all blocks before
+    // streamFlushed have been written to streamFile
+    FILE* streamFile = NULL;
+    std::map<spiffs_block_ix, std::vector<u8_t>> streamBlocks;
+    u32_t streamFlushed = 0;
+    Sha256 streamSha;
+
+    // --update state: files of the existing image not yet seen in the
+    // source directory, with their sizes
+    bool update = false;
+    std::map<std::string, u32_t> updateFiles;
+    size_t updateUnchanged = 0;
+
+    // SHA-256 of the created image, with --reproducible
+    std::string digest;
+
+    // Number of bytes copied out of flashmem by SPIFFS reads, and number of
+    // bytes read by mkspiffs itself through pointers into flashmem
+    uint64_t readCopyBytes = 0;
+    std::atomic<uint64_t> readZeroCopyBytes;
+
+    // Blocks of a loaded image with no used lookup entries, which lookup
+    // table scans skip; see scanEmptyBlocks
+    std::vector<bool> emptyBlocks;
+
+    // with --strict-nor, writes which needed bits to change from 0 to 1
+    uint64_t norViolations = 0;
+    u32_t firstNorViolation = 0;
+
+    // objects of a mounted image, see indexImage
+    std::vector<IndexedObject> objects;
+    std::map<spiffs_obj_id, size_t> objectById;
+
+    Stats stats;
+    WearStats wear;
+
+    ImageContext() : readZeroCopyBytes(0)
+    {
+        memset(&fs, 0, sizeof(fs));
+    }
+};
 
-            if (!S_ISREG(path_stat.st_mode)) {
-                // Check if path is a directory.
-                if (S_ISDIR(path_stat.st_mode)) {
-                    // Prepare new sub path.
-                    std::string newSubPath = subPath;
-                    newSubPath += ent->d_name;
-                    newSubPath += "/";
+static ImageContext& contextOf(spiffs* fs)
+{
+    return *reinterpret_cast<ImageContext*>(fs);
+}
 
-                    if (addFiles(dirname, newSubPath.c_str()) != 0) {
-                        std::cerr << "Error for adding content from " << ent->d_name << "!" << std::endl;
-                    }
+// Reads a source file in chunks, from disk or from the source cache.
+class SourceReader
+{
+public:
+    ~SourceReader()
+    {
+        if (m_fp) {
+            fclose(m_fp);
+        }
+    }
 
-                    continue;
-                } else {
-                    std::cerr << "skipping " << ent->d_name << std::endl;
-                    continue;
-                }
+    bool open(ImageContext& ctx, const char* path)
+    {
+        m_readTime = &ctx.stats.sourceRead;
+        if (ctx.prefetched && ctx.prefetchedPath == path) {
+            m_contents = ctx.prefetched;
+            m_size = m_contents->size();
+            return true;
+        }
+        PhaseTimer timer(ctx.stats.sourceRead);
+        if (ctx.sourceCache) {
+            m_contents = ctx.sourceCache->get(path);
+            if (!m_contents) {
+                return false;
             }
+            m_size = m_contents->size();
+            return true;
+        }
+        m_fp = fopen(path, "rb");
+        if (!m_fp) {
+            return false;
+        }
+        m_size = getFileSize(m_fp);
+        return true;
+    }
 
-            // Filepath with dirname as root folder.
-            std::string filepath = subPath;
-            filepath += ent->d_name;
-            std::cout << filepath << std::endl;
+    size_t size() const
+    {
+        return m_size;
+    }
 
-            // Add File to image.
-            if (addFile((char*)filepath.c_str(), fullpath.c_str()) != 0) {
-                std::cerr << "error adding file!" << std::endl;
-                error = true;
-                if (s_debugLevel > 0) {
-                    std::cout << std::endl;
-                }
-                break;
-            }
-        } // end while
-        closedir (dir);
-    } else {
-        std::cerr << "warning: can't read source directory" << std::endl;
-        return 1;
+    // returns pointer to the next len bytes of the file, or NULL on error
+    const uint8_t* read(size_t len)
+    {
+        if (m_contents) {
+            const uint8_t* data = &(*m_contents)[0] + m_offset;
+            m_offset += len;
+            return (m_offset <= m_size) ? data : NULL;
+        }
+        PhaseTimer timer(*m_readTime);
+        if (m_buffer.size() < len) {
+            m_buffer.resize(len);
+        }
+        if (len != fread(&m_buffer[0], 1, len, m_fp)) {
+            return NULL;
+        }
+        return &m_buffer[0];
     }
 
-    return (error) ? 1 : 0;
-}
+private:
+    FILE* m_fp = NULL;
+    Duration* m_readTime = NULL;
+    SourceCache::Contents m_contents;
+    std::vector<uint8_t> m_buffer;
+    size_t m_size = 0;
+    size_t m_offset = 0;
+};
 
-void listFiles()
+static bool isErased(const u8_t* data, size_t size)
 {
-    spiffs_DIR dir;
-    spiffs_dirent ent;
-
-    SPIFFS_opendir(&s_fs, 0, &dir);
-    spiffs_dirent* it;
-    while (true) {
-        it = SPIFFS_readdir(&dir, &ent);
-        if (!it) {
-            break;
-        }
-
-        std::cout << it->size << '\t' << it->name << std::endl;
+    // whole words first
+    uint64_t acc = ~(uint64_t) 0;
+    size_t i = 0;
+    for (; i + sizeof(acc) <= size; i += sizeof(acc)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        acc &= word;
+    }
+    for (; i < size; ++i) {
+        acc &= 0xffffffffffffff00ull | data[i];
     }
-    SPIFFS_closedir(&dir);
+    return acc == ~(uint64_t) 0;
 }
 
 /**
- * @brief Check if directory exists.
- * @param path Directory path.
- * @return True if exists otherwise false.
+ * @brief Check whether flash contents can be programmed to src, which is
+ * only possible if src has no bits set which are 0 in dst.
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * On x86 hosts 32 or 16 bytes are checked at a time.
  */
-bool dirExists(const char* path)
+static bool norCanProgram(const u8_t* dst, const u8_t* src, size_t size)
 {
-    DIR *d = opendir(path);
-
-    if (d) {
-        closedir(d);
-        return true;
+    size_t i = 0;
+#if MKSPIFFS_AVX2
+    __m256i set256 = _mm256_setzero_si256();
+    for (; i + 32 <= size; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        set256 = _mm256_or_si256(set256, _mm256_andnot_si256(d, s));
     }
-
-    return false;
+    if (!_mm256_testz_si256(set256, set256)) {
+        return false;
+    }
+#endif
+#if MKSPIFFS_SSE2
+    __m128i set128 = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        set128 = _mm_or_si128(set128, _mm_andnot_si128(d, s));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(set128, _mm_setzero_si128())) != 0xffff) {
+        return false;
+    }
+#endif
+    u8_t set = 0;
+    for (; i < size; ++i) {
+        set |= src[i] & ~dst[i];
+    }
+    return set == 0;
 }
 
 /**
- * @brief Create directory if it not exists.
- * @param path Directory path.
- * @return True or false.
+ * @brief Program flash the way NOR flash does: bits can only be cleared, so
+ * dst becomes dst & src.
+ * @return False if src had bits set which were 0 in dst.
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * On x86 hosts 32 or 16 bytes are programmed at a time.
  */
-bool dirCreate(const char* path)
+static bool norProgram(u8_t* dst, const u8_t* src, size_t size)
 {
-    // Check if directory also exists.
-    if (dirExists(path)) {
-        return false;
+    size_t i = 0;
+    bool ok = true;
+#if MKSPIFFS_AVX2
+    __m256i set256 = _mm256_setzero_si256();
+    for (; i + 32 <= size; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        set256 = _mm256_or_si256(set256, _mm256_andnot_si256(d, s));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_and_si256(d, s));
     }
-
-    // platform stuff...
-#if defined(_WIN32)
-    if (_mkdir(path) != 0) {
-#else
-    if (mkdir(path, S_IRWXU | S_IXGRP | S_IRGRP | S_IROTH | S_IXOTH) != 0) {
+    ok = _mm256_testz_si256(set256, set256);
 #endif
-        std::cerr << "Can not create directory!!!" << std::endl;
-        return false;
+#if MKSPIFFS_SSE2
+    __m128i set128 = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        set128 = _mm_or_si128(set128, _mm_andnot_si128(d, s));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(d, s));
     }
-
-    return true;
+    ok = ok && _mm_movemask_epi8(_mm_cmpeq_epi8(set128, _mm_setzero_si128())) == 0xffff;
+#endif
+    u8_t set = 0;
+    for (; i < size; ++i) {
+        set |= src[i] & ~dst[i];
+        dst[i] &= src[i];
+    }
+    return ok && set == 0;
 }
 
 /**
- * @brief Unpack file from file system.
- * @param spiffsFile SPIFFS dir entry pointer.
- * @param destPath Destination file path path.
- * @return True or false.
+ * @brief Find the next entry of a lookup table which belongs to an object
+ * index page, i.e. has SPIFFS_OBJ_ID_IX_FLAG set and isn't free.
+ * @param lu Lookup table.
+ * @param start First entry to look at.
+ * @param entries Number of entries in the table.
+ * @return Index of the entry, or `entries` if there is none.
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * Most entries of a used block belong to data pages, so on x86 hosts 8 or
+ * 16 entries are checked at a time.
  */
-bool unpackFile(spiffs_dirent *spiffsFile, const char *destPath)
+static u32_t lookupFindIndex(const u8_t* lu, u32_t start, u32_t entries)
 {
-    u8_t buffer[spiffsFile->size];
-    std::string filename = (const char*)(spiffsFile->name);
-
-    // Open file from spiffs file system.
-    spiffs_file src = SPIFFS_open(&s_fs, (char *)(filename.c_str()), SPIFFS_RDONLY, 0);
-
-    // read content into buffer
-    SPIFFS_read(&s_fs, src, buffer, spiffsFile->size);
+    u32_t e = start;
+#if MKSPIFFS_SSE2
+    if (sizeof(spiffs_obj_id) == 2 && SPIFFS_OBJ_ID_IX_FLAG == 0x8000) {
+#if MKSPIFFS_AVX2
+        const __m256i free256 = _mm256_set1_epi16((short) SPIFFS_OBJ_ID_FREE);
+        for (; e + 16 <= entries; e += 16) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(lu + e * 2));
+            __m256i ix = _mm256_andnot_si256(_mm256_cmpeq_epi16(v, free256), _mm256_srai_epi16(v, 15));
+            u32_t mask = (u32_t) _mm256_movemask_epi8(ix);
+            if (mask) {
+                return e + __builtin_ctz(mask) / 2;
+            }
+        }
+#endif
+        const __m128i free128 = _mm_set1_epi16((short) SPIFFS_OBJ_ID_FREE);
+        for (; e + 8 <= entries; e += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(lu + e * 2));
+            __m128i ix = _mm_andnot_si128(_mm_cmpeq_epi16(v, free128), _mm_srai_epi16(v, 15));
+            u32_t mask = (u32_t) _mm_movemask_epi8(ix);
+            if (mask) {
+                return e + __builtin_ctz(mask) / 2;
+            }
+        }
+    }
+#endif
+    for (; e < entries; ++e) {
+        spiffs_obj_id id;
+        memcpy(&id, lu + e * sizeof(id), sizeof(id));
+        if ((id & SPIFFS_OBJ_ID_IX_FLAG) && id != SPIFFS_OBJ_ID_FREE) {
+            return e;
+        }
+    }
+    return entries;
+}
 
-    // Close spiffs file.
-    SPIFFS_close(&s_fs, src);
+static s32_t api_spiffs_read(spiffs* fs, u32_t addr, u32_t size, u8_t *dst)
+{
+    ImageContext& ctx = contextOf(fs);
+    ctx.stats.halReads++;
+    ctx.stats.halReadBytes += size;
+    if (s_flashTiming) {
+        ctx.stats.flashReadUs += size * s_flashTiming->readNsPerByte / 1000;
+    }
+    memcpy(dst, ctx.flashmem.data() + addr, size);
+    ctx.readCopyBytes += size;
+    return SPIFFS_OK;
+}
 
-    // Open file.
-    FILE* dst = fopen(destPath, "wb");
+/**
+ * @brief Zero-copy read: get a pointer to image contents.
+ * @param ctx Image context.
+ * @param addr Flash address.
+ * @param size Number of bytes which will be read through the pointer.
+ * @return Pointer into ctx.flashmem.
+ */
+static const u8_t* flashRead(ImageContext& ctx, u32_t addr, u32_t size)
+{
+    ctx.readZeroCopyBytes += size;
+    return ctx.flashmem.data() + addr;
+}
 
-    // Write content into file.
-    fwrite(buffer, sizeof(u8_t), sizeof(buffer), dst);
+/**
+ * @brief Size the wear counters for the current image. They start over when
+ * the image size changes, e.g. when --auto-size retries with a larger image.
+ */
+static void wearPrepare(ImageContext& ctx)
+{
+    size_t pageCount = ctx.flashmem.size() / ctx.pageSize;
+    if (ctx.wear.pagePrograms.size() != pageCount) {
+        ctx.wear = WearStats();
+        ctx.wear.pagePrograms.assign(pageCount, 0);
+        ctx.wear.blockErases.assign(ctx.flashmem.size() / ctx.blockSize, 0);
+    }
+}
 
-    // Close file.
-    fclose(dst);
+/**
+ * @brief Count a program operation on each page in the range, and check that
+ * it only clears bits of the current contents.
+ */
+static void wearRecordWrite(ImageContext& ctx, u32_t addr, u32_t size, const u8_t* src)
+{
+    if (size == 0) {
+        return;
+    }
+    wearPrepare(ctx);
+    for (u32_t page = addr / ctx.pageSize; page <= (addr + size - 1) / ctx.pageSize; ++page) {
+        ctx.wear.pagePrograms[page]++;
+    }
+
+    const u8_t* dst = ctx.flashmem.data() + addr;
+    if (norCanProgram(dst, src, size)) {
+        return;
+    }
+    uint64_t bits = 0;
+    for (u32_t i = 0; i < size; ++i) {
+        for (u8_t set = src[i] & ~dst[i]; set; set &= set - 1) {
+            bits++;
+        }
+    }
+    if (ctx.wear.illegalWrites == 0) {
+        ctx.wear.firstIllegalAddr = addr;
+    }
+    ctx.wear.illegalWrites++;
+    ctx.wear.illegalBits += bits;
+}
+
+static void wearRecordErase(ImageContext& ctx, u32_t addr, u32_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    wearPrepare(ctx);
+    for (u32_t bix = addr / ctx.blockSize; bix <= (addr + size - 1) / ctx.blockSize; ++bix) {
+        ctx.wear.blockErases[bix]++;
+    }
+}
+
+static s32_t api_spiffs_write(spiffs* fs, u32_t addr, u32_t size, u8_t *src)
+{
+    ImageContext& ctx = contextOf(fs);
+    ctx.stats.halWrites++;
+    ctx.stats.halWriteBytes += size;
+    if (s_flashTiming && size > 0) {
+        u32_t pages = (addr + size - 1) / physicalFlashProgramPageSize - addr / physicalFlashProgramPageSize + 1;
+        ctx.stats.flashProgramUs += pages * s_flashTiming->programUsPerPage;
+    }
+    if (s_wear) {
+        wearRecordWrite(ctx, addr, size, src);
+    }
+    if (!s_strictNor) {
+        memcpy(ctx.flashmem.writeData() + addr, src, size);
+    } else if (!norProgram(ctx.flashmem.writeData() + addr, src, size)) {
+        if (ctx.norViolations == 0) {
+            ctx.firstNorViolation = addr;
+        }
+        ctx.norViolations++;
+    }
+    if (!ctx.emptyBlocks.empty() && size > 0) {
+        for (u32_t bix = addr / ctx.blockSize; bix <= (addr + size - 1) / ctx.blockSize; ++bix) {
+            ctx.emptyBlocks[bix] = false;
+        }
+    }
+    return SPIFFS_OK;
+}
+
+static s32_t api_spiffs_erase(spiffs* fs, u32_t addr, u32_t size)
+{
+    ImageContext& ctx = contextOf(fs);
+    ctx.stats.halErases++;
+    ctx.stats.halEraseBytes += size;
+    if (s_flashTiming) {
+        u32_t sectors = (size + physicalFlashEraseBlockSize - 1) / physicalFlashEraseBlockSize;
+        ctx.stats.flashEraseUs += sectors * s_flashTiming->eraseMsPerSector * 1000;
+    }
+    if (s_wear) {
+        wearRecordErase(ctx, addr, size);
+    }
+    memset(ctx.flashmem.writeData() + addr, 0xff, size);
+    return SPIFFS_OK;
+}
+
+static int checkArgs(const ImageContext& ctx);
+static int loadImage(ImageContext& ctx, const std::string& fileName);
+
+/**
+ * @brief Find empty blocks of a loaded image.
+ *
+ * Only the lookup table of each block is read, so pages of a mapped image
+ * which SPIFFS doesn't touch are not faulted in.
+ */
+static void scanEmptyBlocks(ImageContext& ctx)
+{
+    const u32_t pagesPerBlock = ctx.blockSize / ctx.pageSize;
+    const u32_t lookupEntries = pagesPerBlock - std::max<u32_t>(1, pagesPerBlock * sizeof(spiffs_obj_id) / ctx.pageSize);
+    const u8_t* data = ctx.flashmem.data();
+
+    ctx.emptyBlocks.assign(ctx.imageSize / ctx.blockSize, false);
+    for (u32_t bix = 0; bix < ctx.emptyBlocks.size(); ++bix) {
+        ctx.emptyBlocks[bix] = isErased(data + bix * ctx.blockSize, lookupEntries * sizeof(spiffs_obj_id));
+    }
+}
+
+/**
+ * @brief Number of worker threads to use, from the -j option.
+ * @param maxWorkers Upper limit, e.g. number of work items.
+ */
+static size_t workerCount(size_t maxWorkers = SIZE_MAX)
+{
+#if MKSPIFFS_THREADS
+    size_t count = (s_jobCount > 0) ? s_jobCount : std::thread::hardware_concurrency();
+    if (count == 0) {
+        count = 1;
+    }
+    return std::min(count, maxWorkers);
+#else
+    (void) maxWorkers;
+    return 1;
+#endif
+}
+
+//implementation
+
+int spiffsTryMount(ImageContext& ctx)
+{
+    spiffs_config cfg = {0};
+
+    cfg.phys_addr = 0x0000;
+    cfg.phys_size = (u32_t) ctx.flashmem.size();
+
+    cfg.phys_erase_block = ctx.blockSize;
+    cfg.log_block_size = ctx.blockSize;
+    cfg.log_page_size = ctx.pageSize;
+
+    cfg.hal_read_f = api_spiffs_read;
+    cfg.hal_write_f = api_spiffs_write;
+    cfg.hal_erase_f = api_spiffs_erase;
 
+    const int maxOpenFiles = 4;
+    ctx.workBuf.resize(ctx.pageSize * 2);
+    ctx.fds.resize(32 * maxOpenFiles);
+    ctx.cache.resize((32 + ctx.pageSize) * maxOpenFiles);
+
+    return SPIFFS_mount(&ctx.fs, &cfg,
+                        &ctx.workBuf[0],
+                        &ctx.fds[0], ctx.fds.size(),
+                        &ctx.cache[0], ctx.cache.size(),
+                        NULL);
+}
 
+bool spiffsMount(ImageContext& ctx, bool printError = true)
+{
+    if (SPIFFS_mounted(&ctx.fs)) {
+        return true;
+    }
+    PhaseTimer timer(ctx.stats.mount);
+    double flashBefore = flashTimeUs(ctx.stats);
+    int res = spiffsTryMount(ctx);
+    ctx.stats.flashMountUs += flashTimeUs(ctx.stats) - flashBefore;
+    if (res != SPIFFS_OK) {
+        if (printError) {
+            std::cerr << "SPIFFS mount failed with error: " << res << std::endl;
+        }
+        return false;
+    }
     return true;
 }
 
+bool spiffsFormat(ImageContext& ctx)
+{
+    PhaseTimer timer(ctx.stats.format);
+    spiffsMount(ctx, false);
+    SPIFFS_unmount(&ctx.fs);
+    int formated = SPIFFS_format(&ctx.fs);
+    if (formated != SPIFFS_OK) {
+        return false;
+    }
+    return (spiffsTryMount(ctx) == SPIFFS_OK);
+}
+
+void spiffsUnmount(ImageContext& ctx)
+{
+    if (SPIFFS_mounted(&ctx.fs)) {
+#if SPIFFS_CACHE && SPIFFS_CACHE_STATS
+        ctx.stats.cacheHits += ctx.fs.cache_hits;
+        ctx.stats.cacheMisses += ctx.fs.cache_misses;
+#endif
+#if SPIFFS_GC_STATS
+        ctx.stats.gcRuns += ctx.fs.stats_gc_runs;
+#endif
+        SPIFFS_unmount(&ctx.fs);
+    }
+}
+
+// Direct layout
+//
+// When creating a new image, files can be written straight into the image
+// instead of going through the SPIFFS API: pages are allocated in one linear
+// pass over the formatted image, and the lookup table entries, object index
+// pages and data pages are filled in the same way SPIFFS would fill them.
+//
+// Sizes of on-flash structures are computed from the format profile rather
+// than taken from the SPIFFS headers, so that images for any of the profiles
+// can be created by the same binary.
+
+// page header, alignment, size, type, name, meta; aligned tables round the
+// header up to a multiple of the page index size
+static constexpr u32_t objIxHeaderSize(u32_t metaLen, bool aligned)
+{
+    return aligned ?
+           (sizeof(spiffs_page_header) + 3 + 4 + 1 + SPIFFS_OBJ_NAME_LEN + metaLen + sizeof(spiffs_page_ix) - 1) & ~(sizeof(spiffs_page_ix) - 1) :
+           sizeof(spiffs_page_header) + 3 + 4 + 1 + SPIFFS_OBJ_NAME_LEN + metaLen;
+}
+
+static_assert(objIxHeaderSize(SPIFFS_OBJ_META_LEN, SPIFFS_ALIGNED_OBJECT_INDEX_TABLES) == sizeof(spiffs_page_object_ix_header),
+              "object index header size doesn't match spiffs_nucleus.h");
+
+static LayoutGeometry layoutGeometry(u32_t pageSize, u32_t blockSize, u32_t imageSize, const FormatProfile* profile)
+{
+    LayoutGeometry g;
+    g.pageSize = pageSize;
+    g.blockSize = blockSize;
+    g.blockCount = imageSize / blockSize;
+    g.pagesPerBlock = g.blockSize / g.pageSize;
+    g.lookupPages = std::max<u32_t>(1, g.pagesPerBlock * sizeof(spiffs_obj_id) / g.pageSize);
+    g.lookupEntries = g.pagesPerBlock - g.lookupPages;
+    g.dataPageSize = g.pageSize - sizeof(spiffs_page_header);
+    g.ixHeaderSize = objIxHeaderSize(profile->metaLen, profile->alignedObjectIndexTables);
+    g.hdrIxLen = (g.pageSize - g.ixHeaderSize) / sizeof(spiffs_page_ix);
+    g.ixLen = (g.pageSize - sizeof(spiffs_page_object_ix)) / sizeof(spiffs_page_ix);
+    return g;
+}
+
+static LayoutGeometry layoutGeometry(const ImageContext& ctx)
+{
+    return layoutGeometry(ctx.pageSize, ctx.blockSize, ctx.imageSize, ctx.profile);
+}
+
+// Write erase count and magic of a block, same as SPIFFS_format does
+static void layoutFormatBlock(ImageContext& ctx, spiffs_block_ix bix, u8_t* block)
+{
+    const LayoutGeometry& g = ctx.geometry;
+    u8_t* lookupEnd = block + g.lookupPages * g.pageSize;
+    spiffs_obj_id eraseCount = 0;
+    memcpy(lookupEnd - sizeof(spiffs_obj_id), &eraseCount, sizeof(eraseCount));
+    if (ctx.profile->useMagic) {
+        u32_t magic = 0x20140529 ^ g.pageSize;
+        if (ctx.profile->useMagicLength) {
+            magic ^= g.blockCount - bix;
+        }
+        spiffs_obj_id magicId = (spiffs_obj_id) magic;
+        memcpy(lookupEnd - 2 * sizeof(spiffs_obj_id), &magicId, sizeof(magicId));
+    }
+}
+
+static void layoutFormat(ImageContext& ctx)
+{
+    // streamed blocks are formatted when they are first used
+    if (ctx.streamFile) {
+        return;
+    }
+    for (u32_t bix = 0; bix < ctx.geometry.blockCount; ++bix) {
+        layoutFormatBlock(ctx, bix, ctx.flashmem.data() + bix * ctx.geometry.blockSize);
+    }
+}
+
+static u8_t* layoutBlockPtr(ImageContext& ctx, spiffs_block_ix bix)
+{
+    if (!ctx.streamFile) {
+        return ctx.flashmem.data() + bix * ctx.geometry.blockSize;
+    }
+    std::vector<u8_t>& block = ctx.streamBlocks[bix];
+    if (block.empty()) {
+        block.assign(ctx.geometry.blockSize, 0xff);
+        layoutFormatBlock(ctx, bix, &block[0]);
+    }
+    return &block[0];
+}
+
+static u8_t* layoutPagePtr(ImageContext& ctx, spiffs_page_ix pix)
+{
+    const LayoutGeometry& g = ctx.geometry;
+    return layoutBlockPtr(ctx, pix / g.pagesPerBlock) + (pix % g.pagesPerBlock) * g.pageSize;
+}
+
 /**
- * @brief Unpack files from file system.
- * @param sDest Directory path as std::string.
+ * @brief With --stream, write blocks before endBlock to the output file and
+ * free them.
  * @return True or false.
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
- *
- * todo: Do unpack stuff for directories.
+ * Blocks which were never used are written as formatted empty blocks.
  */
-bool unpackFiles(std::string sDest)
+static bool layoutFlush(ImageContext& ctx, u32_t endBlock)
 {
-    spiffs_DIR dir;
-    spiffs_dirent ent;
+    PhaseTimer timer(ctx.stats.imageIo);
+    const LayoutGeometry& g = ctx.geometry;
+    std::vector<u8_t> empty;
+    bool ok = true;
+    for (; ctx.streamFlushed < endBlock; ++ctx.streamFlushed) {
+        const u8_t* data;
+        auto it = ctx.streamBlocks.find(ctx.streamFlushed);
+        if (it != ctx.streamBlocks.end()) {
+            data = &it->second[0];
+        } else {
+            empty.assign(g.blockSize, 0xff);
+            layoutFormatBlock(ctx, ctx.streamFlushed, &empty[0]);
+            data = &empty[0];
+        }
+        ok = ok && fwrite(data, 1, g.blockSize, ctx.streamFile) == g.blockSize;
+        ctx.streamSha.update(data, g.blockSize);
+        if (it != ctx.streamBlocks.end()) {
+            ctx.streamBlocks.erase(it);
+        }
+    }
+    return ok;
+}
 
-    // Add "./" to path if is not given.
-    if (sDest.find("./") == std::string::npos && sDest.find("/") == std::string::npos) {
-        sDest = "./" + sDest;
+void layoutBegin(ImageContext& ctx)
+{
+    PhaseTimer timer(ctx.stats.format);
+    ctx.geometry = layoutGeometry(ctx);
+    ctx.layoutFiles.clear();
+    ctx.layoutSources.clear();
+    ctx.layoutFill.assign(ctx.geometry.blockCount, 0);
+    ctx.layoutBlock = 0;
+    ctx.layoutObjId = 1;
+    layoutFormat(ctx);
+}
+
+// Last two blocks are left free, same as SPIFFS does: they are needed for
+// garbage collection once the image is used on the device
+static u32_t layoutUsableBlocks(const LayoutGeometry& g)
+{
+    return (g.blockCount > 2) ? g.blockCount - 2 : 0;
+}
+
+// Allocate the next free page at or after ctx.layoutBlock. With
+// --block-slack, the last pages of each block are only used once all other
+// blocks are full.
+static bool layoutAllocPage(ImageContext& ctx, spiffs_obj_id lookupId, spiffs_page_ix* pix)
+{
+    const LayoutGeometry& g = ctx.geometry;
+    const u32_t usableBlocks = layoutUsableBlocks(g);
+    const u32_t slack = s_stablePlacement ? s_blockSlack : 0;
+
+    for (u32_t limit : { g.lookupEntries - slack, g.lookupEntries }) {
+        for (u32_t i = 0; i < usableBlocks; ++i) {
+            spiffs_block_ix bix = (ctx.layoutBlock + i) % usableBlocks;
+            u32_t entry = ctx.layoutFill[bix];
+            if (entry >= limit) {
+                continue;
+            }
+
+            *pix = bix * g.pagesPerBlock + g.lookupPages + entry;
+            memcpy(layoutBlockPtr(ctx, bix) + entry * sizeof(spiffs_obj_id), &lookupId, sizeof(lookupId));
+            ctx.layoutFill[bix] = entry + 1;
+            ctx.layoutBlock = bix;
+            return true;
+        }
     }
+    return false;
+}
 
-    // Check if directory exists. If it does not then try to create it with permissions 755.
-    if (! dirExists(sDest.c_str())) {
-        std::cout << "Directory " << sDest << " does not exists. Try to create it." << std::endl;
+static void layoutSetIndexEntry(ImageContext& ctx, spiffs_page_ix ixPix, bool header, int entry, spiffs_page_ix dataPix)
+{
+    size_t offset = header ? ctx.geometry.ixHeaderSize : sizeof(spiffs_page_object_ix);
+    memcpy(layoutPagePtr(ctx, ixPix) + offset + entry * sizeof(spiffs_page_ix), &dataPix, sizeof(dataPix));
+}
 
-        // Try to create directory.
-        if (! dirCreate(sDest.c_str())) {
-            return false;
+static int layoutWriteFile(ImageContext& ctx, const char* name, const char* path, spiffs_obj_id objId)
+{
+    SourceReader src;
+    if (!src.open(ctx, path)) {
+        std::cerr << "error: failed to open " << path << " for reading" << std::endl;
+        return 1;
+    }
+
+    size_t size = src.size();
+
+    if (s_debugLevel > 0) {
+        std::cout << "file size: " << size << std::endl;
+    }
+
+    const LayoutGeometry& g = ctx.geometry;
+    const spiffs_obj_id ixId = objId | SPIFFS_OBJ_ID_IX_FLAG;
+    const u8_t ixFlags = 0xff & ~(SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_USED);
+
+    // object index header: page header, alignment, size, type, name, meta
+    spiffs_page_ix hdrPix;
+    if (!layoutAllocPage(ctx, ixId, &hdrPix)) {
+        std::cerr << "error: File system is full." << std::endl;
+        return 1;
+    }
+    u8_t* hdr = layoutPagePtr(ctx, hdrPix);
+    spiffs_page_header hdrPh;
+    hdrPh.obj_id = ixId;
+    hdrPh.span_ix = 0;
+    hdrPh.flags = ixFlags;
+    memcpy(hdr, &hdrPh, sizeof(hdrPh));
+    u8_t* hdrFields = hdr + sizeof(spiffs_page_header) + 3;
+    u32_t objSize = (u32_t) size;
+    memcpy(hdrFields, &objSize, sizeof(objSize));
+    hdrFields[4] = SPIFFS_TYPE_FILE;
+    memset(hdrFields + 5, 0, SPIFFS_OBJ_NAME_LEN);
+    strncpy((char*) hdrFields + 5, name, SPIFFS_OBJ_NAME_LEN);
+
+    // data pages, with an object index page in front of each run of data
+    // pages which doesn't fit into the previous index page
+    spiffs_page_ix ixPix = hdrPix;
+    u32_t ixEntry = 0;
+    spiffs_span_ix ixSpan = 0;
+    size_t left = size;
+    for (spiffs_span_ix dataSpan = 0; left > 0; ++dataSpan) {
+        if ((ixSpan == 0 && ixEntry == g.hdrIxLen) || (ixSpan > 0 && ixEntry == g.ixLen)) {
+            ++ixSpan;
+            ixEntry = 0;
+            if (!layoutAllocPage(ctx, ixId, &ixPix)) {
+                std::cerr << "error: File system is full." << std::endl;
+                return 1;
+            }
+            spiffs_page_header ixPh;
+            ixPh.obj_id = ixId;
+            ixPh.span_ix = ixSpan;
+            ixPh.flags = ixFlags;
+            memcpy(layoutPagePtr(ctx, ixPix), &ixPh, sizeof(ixPh));
+        }
+
+        spiffs_page_ix dataPix;
+        if (!layoutAllocPage(ctx, objId, &dataPix)) {
+            std::cerr << "error: File system is full." << std::endl;
+            if (s_debugLevel > 0) {
+                std::cout << "data left: " << left << std::endl;
+            }
+            return 1;
+        }
+        spiffs_page_header ph;
+        ph.obj_id = objId;
+        ph.span_ix = dataSpan;
+        ph.flags = 0xff & ~(SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_USED);
+        u8_t* page = layoutPagePtr(ctx, dataPix);
+        memcpy(page, &ph, sizeof(ph));
+
+        size_t chunk = (left < g.dataPageSize) ? left : g.dataPageSize;
+        const uint8_t* data = src.read(chunk);
+        if (!data) {
+            std::cerr << "fread error!" << std::endl;
+            return 1;
         }
+        memcpy(page + sizeof(ph), data, chunk);
+        left -= chunk;
+
+        layoutSetIndexEntry(ctx, ixPix, ixSpan == 0, ixEntry++, dataPix);
     }
 
-    // Open directory.
-    SPIFFS_opendir(&s_fs, 0, &dir);
+    LayoutFile file;
+    file.name = name;
+    file.size = (u32_t) size;
+    ctx.layoutFiles.push_back(file);
 
-    // Read content from directory.
-    spiffs_dirent* it = SPIFFS_readdir(&dir, &ent);
-    while (it) {
-        // Check if content is a file.
-        if ((int)(it->type) == 1) {
-            std::string name = (const char*)(it->name);
-            std::string sDestFilePath = sDest + name;
-            size_t pos = name.find_first_of("/", 1);
+    // blocks before the current one only hold pages of files which are done
+    if (ctx.streamFile && !layoutFlush(ctx, ctx.layoutBlock)) {
+        std::cerr << "error: failed to write image file" << std::endl;
+        return 1;
+    }
+    return 0;
+}
 
-            // If file is in sub directories?
-            while (pos != std::string::npos) {
-                // Subdir path.
-                std::string path = sDest;
-                path += name.substr(0, pos);
+// FNV-1a
+static u32_t layoutNameHash(const std::string& name)
+{
+    u32_t hash = 2166136261u;
+    for (char c : name) {
+        hash = (hash ^ (u8_t) c) * 16777619u;
+    }
+    return hash;
+}
 
-                // Create subddir if subdir not exists.
-                if (!dirExists(path.c_str())) {
-                    if (!dirCreate(path.c_str())) {
-                        return false;
-                    }
-                }
+int layoutFile(ImageContext& ctx, const char* name, const char* path)
+{
+    if (strlen(name) > SPIFFS_OBJ_NAME_LEN - 1) {
+        std::cerr << "error: file name " << name << " is too long" << std::endl;
+        return 1;
+    }
 
-                pos = name.find_first_of("/", pos + 1);
+    if (!s_stablePlacement) {
+        return layoutWriteFile(ctx, name, path, ctx.layoutObjId++);
+    }
+
+    // placed by layoutPlaceSources once all files are known
+    LayoutSource source;
+    source.name = name;
+    source.path = path;
+    source.hash = layoutNameHash(source.name);
+    u32_t usableBlocks = layoutUsableBlocks(ctx.geometry);
+    source.home = usableBlocks ? source.hash % usableBlocks : 0;
+    ctx.layoutSources.push_back(source);
+    return 0;
+}
+
+/**
+ * @brief Place files collected with --stable-placement.
+ * @return 0 success, otherwise error
+ *
+ * Each file starts at a home block and gets an object id, both derived from
+ * a hash of its name. Files are placed in order of home block and name, so
+ * the placement doesn't depend on the order in which the directory was read,
+ * and adding, removing or resizing a file only moves the files which follow
+ * it up to the next block with enough free pages (see --block-slack).
+ */
+int layoutPlaceSources(ImageContext& ctx)
+{
+    std::sort(ctx.layoutSources.begin(), ctx.layoutSources.end(), [](const LayoutSource& a, const LayoutSource& b) {
+        return (a.home != b.home) ? a.home < b.home : a.name < b.name;
+    });
+
+    // SPIFFS looks for free object ids up to this value
+    const u32_t maxObjId = std::min<u32_t>(ctx.geometry.blockCount * ctx.geometry.lookupEntries / 2, SPIFFS_OBJ_ID_IX_FLAG - 2);
+    if (ctx.layoutSources.size() > maxObjId) {
+        std::cerr << "error: too many files for the image size" << std::endl;
+        return 1;
+    }
+    std::vector<bool> usedIds(maxObjId + 1, false);
+
+    for (const LayoutSource& source : ctx.layoutSources) {
+        spiffs_obj_id objId = 1 + source.hash % maxObjId;
+        while (usedIds[objId]) {
+            objId = (objId == maxObjId) ? 1 : objId + 1;
+        }
+        usedIds[objId] = true;
+
+        if (s_debugLevel > 0) {
+            std::cout << source.name << ": home block " << source.home << ", object id " << objId << std::endl;
+        }
+        ctx.layoutBlock = source.home;
+        if (layoutWriteFile(ctx, source.name.c_str(), source.path.c_str(), objId) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Check an image created for a format profile which the SPIFFS built
+ * into mkspiffs can't mount, by reading it the way SPIFFS built for that
+ * profile would.
+ * @return True if the image holds the files of ctx.layoutFiles, and no
+ * others, with their sizes, and each data page is where the object index
+ * says.
+ *
+ * Offsets are worked out here from the profile rather than taken from
+ * LayoutGeometry, so that a mistake in the layout engine isn't repeated by
+ * the check.
+ */
+static bool layoutVerifyProfile(ImageContext& ctx)
+{
+    const FormatProfile& profile = *ctx.profile;
+    const u32_t pageSize = ctx.pageSize;
+    const u32_t blockCount = ctx.imageSize / ctx.blockSize;
+    const u32_t pagesPerBlock = ctx.blockSize / pageSize;
+    const u32_t lookupPages = std::max<u32_t>(1, pagesPerBlock * sizeof(spiffs_obj_id) / pageSize);
+    const u32_t lookupEntries = pagesPerBlock - lookupPages;
+    const u32_t dataPageSize = pageSize - sizeof(spiffs_page_header);
+
+    // object index header: page header, alignment, size, type, name, meta,
+    // then the data page indices of the first span
+    const u32_t sizeOffset = sizeof(spiffs_page_header) + 3;
+    const u32_t typeOffset = sizeOffset + 4;
+    const u32_t nameOffset = typeOffset + 1;
+    u32_t hdrEntriesOffset = nameOffset + SPIFFS_OBJ_NAME_LEN + profile.metaLen;
+    if (profile.alignedObjectIndexTables) {
+        hdrEntriesOffset = (hdrEntriesOffset + sizeof(spiffs_page_ix) - 1) & ~(sizeof(spiffs_page_ix) - 1);
+    }
+    const u32_t hdrIxLen = (pageSize - hdrEntriesOffset) / sizeof(spiffs_page_ix);
+    const u32_t ixLen = (pageSize - sizeof(spiffs_page_object_ix)) / sizeof(spiffs_page_ix);
+
+    const u8_t flagsMask = SPIFFS_PH_FLAG_USED | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX |
+                           SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE;
+    const u8_t ixFlags = SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE;
+    const u8_t dataFlags = SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE;
+
+    u8_t* image = ctx.flashmem.data();
+    auto pagePtr = [&](u32_t pix) {
+        return image + (size_t) pix * pageSize;
+    };
+    auto pageHeader = [&](u32_t pix) {
+        spiffs_page_header ph;
+        memcpy(&ph, pagePtr(pix), sizeof(ph));
+        return ph;
+    };
+    auto lookupId = [&](u32_t pix) {
+        spiffs_obj_id id;
+        u32_t entry = pix % pagesPerBlock - lookupPages;
+        memcpy(&id, image + (size_t)(pix / pagesPerBlock) * ctx.blockSize + entry * sizeof(id), sizeof(id));
+        return id;
+    };
+
+    for (u32_t bix = 0; bix < blockCount && profile.useMagic; ++bix) {
+        u32_t magic = 0x20140529 ^ pageSize;
+        if (profile.useMagicLength) {
+            magic ^= blockCount - bix;
+        }
+        spiffs_obj_id stored;
+        memcpy(&stored, image + (size_t) bix * ctx.blockSize + lookupPages * pageSize - 2 * sizeof(stored), sizeof(stored));
+        if (stored != (spiffs_obj_id) magic) {
+            std::cerr << "error: block " << bix << " of the image has no valid magic" << std::endl;
+            return false;
+        }
+    }
+
+    // object index pages by object id and span index
+    std::map<spiffs_obj_id, std::map<u32_t, u32_t>> indexPages;
+    for (u32_t bix = 0; bix < blockCount; ++bix) {
+        for (u32_t entry = 0; entry < lookupEntries; ++entry) {
+            u32_t pix = bix * pagesPerBlock + lookupPages + entry;
+            spiffs_obj_id id = lookupId(pix);
+            if (id == SPIFFS_OBJ_ID_FREE || id == SPIFFS_OBJ_ID_DELETED || !(id & SPIFFS_OBJ_ID_IX_FLAG)) {
+                continue;
+            }
+            spiffs_page_header ph = pageHeader(pix);
+            if (ph.obj_id != id || (ph.flags & flagsMask) != ixFlags || !indexPages[id].insert(std::make_pair((u32_t) ph.span_ix, pix)).second) {
+                std::cerr << "error: page " << pix << " of the image is not a valid object index page" << std::endl;
+                return false;
             }
+        }
+    }
 
-            // Unpack file to destination directory.
-            if (! unpackFile(it, sDestFilePath.c_str()) ) {
-                std::cout << "Can not unpack " << it->name << "!" << std::endl;
+    std::map<std::string, u32_t> found;
+    for (const auto& object : indexPages) {
+        const spiffs_obj_id dataId = object.first & ~SPIFFS_OBJ_ID_IX_FLAG;
+        const std::map<u32_t, u32_t>& spans = object.second;
+        auto hdr = spans.find(0);
+        if (hdr == spans.end() || pagePtr(hdr->second)[typeOffset] != SPIFFS_TYPE_FILE) {
+            std::cerr << "error: object " << dataId << " of the image has no valid object index header" << std::endl;
+            return false;
+        }
+        u32_t size;
+        memcpy(&size, pagePtr(hdr->second) + sizeOffset, sizeof(size));
+        std::string name((const char*) pagePtr(hdr->second) + nameOffset, SPIFFS_OBJ_NAME_LEN);
+        name.resize(strnlen(name.c_str(), SPIFFS_OBJ_NAME_LEN));
+
+        for (u32_t span = 0; span < (size + dataPageSize - 1) / dataPageSize; ++span) {
+            u32_t ixSpan = (span < hdrIxLen) ? 0 : 1 + (span - hdrIxLen) / ixLen;
+            u32_t ixEntry = (span < hdrIxLen) ? span : (span - hdrIxLen) % ixLen;
+            auto ix = spans.find(ixSpan);
+            spiffs_page_ix dataPix = (spiffs_page_ix) -1;
+            if (ix != spans.end()) {
+                u32_t offset = (ixSpan == 0) ? hdrEntriesOffset : sizeof(spiffs_page_object_ix);
+                memcpy(&dataPix, pagePtr(ix->second) + offset + ixEntry * sizeof(dataPix), sizeof(dataPix));
+            }
+            bool valid = dataPix < blockCount * pagesPerBlock && dataPix % pagesPerBlock >= lookupPages;
+            if (valid) {
+                spiffs_page_header ph = pageHeader(dataPix);
+                valid = lookupId(dataPix) == dataId && ph.obj_id == dataId && ph.span_ix == span &&
+                        (ph.flags & flagsMask) == dataFlags;
+            }
+            if (!valid) {
+                std::cerr << "error: " << name << " can not be read back from the image" << std::endl;
                 return false;
             }
+        }
+        found[name] = size;
+    }
+
+    bool ok = found.size() == ctx.layoutFiles.size();
+    for (const LayoutFile& file : ctx.layoutFiles) {
+        auto it = found.find(file.name);
+        if (it == found.end() || it->second != file.size) {
+            std::cerr << "error: " << file.name << " can not be read back from the image" << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool layoutVerify(ImageContext& ctx)
+{
+    // images of other profiles can't be mounted by the SPIFFS built into mkspiffs
+    if (ctx.profile != &s_builtinProfile) {
+        return layoutVerifyProfile(ctx);
+    }
+
+    if (!spiffsMount(ctx)) {
+        std::cerr << "error: failed to mount image created with direct layout" << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    for (const LayoutFile& file : ctx.layoutFiles) {
+        spiffs_stat st;
+        if (SPIFFS_stat(&ctx.fs, file.name.c_str(), &st) != SPIFFS_OK || st.size != file.size) {
+            std::cerr << "error: " << file.name << " can not be read back from the image" << std::endl;
+            ok = false;
+        }
+    }
+    spiffsUnmount(ctx);
+    return ok;
+}
+
+int addFile(ImageContext& ctx, char* name, const char* path)
+{
+    if (s_directLayout) {
+        return layoutFile(ctx, name, path);
+    }
+
+    SourceReader src;
+    if (!src.open(ctx, path)) {
+        std::cerr << "error: failed to open " << path << " for reading" << std::endl;
+        return 1;
+    }
+
+    spiffs_file dst = SPIFFS_open(&ctx.fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
+
+    // read file size
+    size_t size = src.size();
+
+    if (s_debugLevel > 0) {
+        std::cout << "file size: " << size << std::endl;
+    }
+
+    // feed SPIFFS_write with whole chunks rather than single bytes, so that
+    // the write path and the page cache are entered once per chunk
+    size_t left = size;
+    while (left > 0) {
+        size_t chunk = (left < (size_t) s_chunkSize) ? left : s_chunkSize;
+        const uint8_t* data = src.read(chunk);
+        if (!data) {
+            std::cerr << "fread error!" << std::endl;
+
+            SPIFFS_close(&ctx.fs, dst);
+            return 1;
+        }
+        int res = SPIFFS_write(&ctx.fs, dst, (void*) data, chunk);
+        if (res < 0) {
+            std::cerr << "SPIFFS_write error(" << ctx.fs.err_code << "): ";
+
+            if (ctx.fs.err_code == SPIFFS_ERR_FULL) {
+                std::cerr << "File system is full." << std::endl;
+            } else {
+                std::cerr << "unknown";
+            }
+            std::cerr << std::endl;
+
+            if (s_debugLevel > 0) {
+                std::cout << "data left: " << left << std::endl;
+            }
+
+            SPIFFS_close(&ctx.fs, dst);
+            return 1;
+        }
+        left -= chunk;
+    }
+
+    SPIFFS_close(&ctx.fs, dst);
+
+    return 0;
+}
+
+/**
+ * @brief Compare a file of the mounted image with a source file.
+ * @param name File name in the image.
+ * @param path Source file path.
+ * @return True if both have the same contents.
+ */
+static bool sameContents(ImageContext& ctx, char* name, const char* path)
+{
+    SourceReader src;
+    if (!src.open(ctx, path)) {
+        return false;
+    }
+
+    spiffs_stat st;
+    if (SPIFFS_stat(&ctx.fs, name, &st) != SPIFFS_OK || st.size != src.size()) {
+        return false;
+    }
+
+    spiffs_file file = SPIFFS_open(&ctx.fs, name, SPIFFS_RDONLY, 0);
+    if (file < 0) {
+        return false;
+    }
+
+    const u32_t dataPageSize = SPIFFS_DATA_PAGE_SIZE(&ctx.fs);
+    ctx.unpackBuf.resize(std::max<size_t>(1, ctx.cache.size() / dataPageSize) * dataPageSize);
+
+    bool same = true;
+    size_t left = st.size;
+    while (same && left > 0) {
+        s32_t chunk = (left < ctx.unpackBuf.size()) ? left : ctx.unpackBuf.size();
+        const uint8_t* data = src.read(chunk);
+        same = data && SPIFFS_read(&ctx.fs, file, &ctx.unpackBuf[0], chunk) == chunk &&
+               memcmp(data, &ctx.unpackBuf[0], chunk) == 0;
+        left -= chunk;
+    }
+
+    SPIFFS_close(&ctx.fs, file);
+    return same;
+}
+
+/**
+ * @brief Add a file to an image opened with --update, unless the image
+ * already holds the same contents under that name.
+ * @return 0 success, otherwise error
+ */
+int updateFile(ImageContext& ctx, char* name, const char* path)
+{
+    auto existing = ctx.updateFiles.find(name);
+    bool found = existing != ctx.updateFiles.end();
+    if (found) {
+        ctx.updateFiles.erase(existing);
+        if (sameContents(ctx, name, path)) {
+            ctx.updateUnchanged++;
+            if (s_debugLevel > 0) {
+                std::cout << name << " (unchanged)" << std::endl;
+            }
+            return 0;
+        }
+    }
+
+    if (!ctx.quiet) {
+        std::cout << name << (found ? " (changed)" : " (new)") << std::endl;
+    }
+    return addFile(ctx, name, path);
+}
+
+// Source file found by collectFiles
+struct SourceFile {
+    std::string name;
+    std::string path;
+    u32_t size;
+};
+
+static bool isIgnoredFileName(const char* name)
+{
+    if (s_addAllFiles) {
+        return false;
+    }
+    size_t ignored_file_names_count = sizeof(ignored_file_names) / sizeof(ignored_file_names[0]);
+    for (size_t i = 0; i < ignored_file_names_count; ++i) {
+        if (strcmp(name, ignored_file_names[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Collect regular files below a directory.
+ * @param dirPath Directory path, ending with a slash.
+ * @param subPath Path of the directory in the image, ending with a slash.
+ * @param dirFd Open descriptor of the directory; closed by this function.
+ * @param files Files found are appended here.
+ * @return 0 success, otherwise error
+ *
+ * Directories are recognised by d_type where the file system provides it.
+ * Other entries are looked at with fstatat relative to the directory, which
+ * also gives the sizes of files, so paths are only built for the files which
+ * end up in the image. Without the *at functions, dirFd is -1 and entries
+ * are looked at by path.
+ */
+static int collectFiles(const std::string& dirPath, const std::string& subPath, int dirFd, std::vector<SourceFile>& files)
+{
+#if !MKSPIFFS_AT_FUNCTIONS
+    (void) dirFd;
+    DIR* dir = opendir(dirPath.c_str());
+#else
+    DIR* dir = (dirFd >= 0) ? fdopendir(dirFd) : NULL;
+    if (!dir && dirFd >= 0) {
+        close(dirFd);
+    }
+#endif
+    if (!dir) {
+        std::cerr << "warning: can't read source directory" << std::endl;
+        return 1;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        // Ignore dir itself.
+        if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) {
+            continue;
+        }
+
+        if (isIgnoredFileName(ent->d_name)) {
+            std::cerr << "skipping " << ent->d_name << std::endl;
+            continue;
+        }
+
+#if defined(_WIN32)
+        bool isDir = false;
+#else
+        bool isDir = ent->d_type == DT_DIR;
+#endif
+        bool isReg = false;
+        struct stat path_stat;
+        if (!isDir) {
+#if MKSPIFFS_AT_FUNCTIONS
+            if (fstatat(dirfd(dir), ent->d_name, &path_stat, 0) == 0) {
+#else
+            if (stat((dirPath + ent->d_name).c_str(), &path_stat) == 0) {
+#endif
+                isReg = S_ISREG(path_stat.st_mode);
+                isDir = S_ISDIR(path_stat.st_mode);
+            }
+        }
+
+        if (isDir) {
+            std::string newDirPath = dirPath + ent->d_name + "/";
+            std::string newSubPath = subPath + ent->d_name + "/";
+#if !MKSPIFFS_AT_FUNCTIONS
+            int subFd = -1;
+#else
+            int subFd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY);
+#endif
+            if (collectFiles(newDirPath, newSubPath, subFd, files) != 0) {
+                std::cerr << "Error for adding content from " << ent->d_name << "!" << std::endl;
+            }
+        } else if (isReg) {
+            SourceFile file;
+            file.name = subPath + ent->d_name;
+            file.path = dirPath + ent->d_name;
+            file.size = (u32_t) path_stat.st_size;
+            files.push_back(file);
+        } else {
+            std::cerr << "skipping " << ent->d_name << std::endl;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+/**
+ * @brief Collect the files below a source directory, sorted by name.
+ * @param dirName Source directory.
+ * @param files Files found are appended here.
+ * @return 0 success, otherwise error
+ *
+ * Files are sorted so that they are added in the same order on every host
+ * regardless of readdir order.
+ */
+static int listSourceFiles(const std::string& dirName, std::vector<SourceFile>& files)
+{
+    std::string dirPath = dirName + "/";
+#if !MKSPIFFS_AT_FUNCTIONS
+    int dirFd = -1;
+#else
+    int dirFd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY);
+#endif
+    if (collectFiles(dirPath, "/", dirFd, files) != 0) {
+        return 1;
+    }
+
+    std::sort(files.begin(), files.end(), [](const SourceFile& a, const SourceFile& b) {
+        return a.name < b.name;
+    });
+    return 0;
+}
+
+#if MKSPIFFS_THREADS
+// Reads source files on a few threads ahead of the thread which writes them
+// into the image. Files are handed out in list order, and at most `depth`
+// files which haven't been taken yet are held in memory.
+class SourcePrefetcher
+{
+public:
+    SourcePrefetcher(const std::vector<SourceFile>& files, size_t depth, size_t threadCount)
+        : m_files(files), m_slots(files.size()), m_depth(depth)
+    {
+        for (size_t i = 0; i < threadCount; ++i) {
+            m_threads.push_back(std::thread([this]() {
+                run();
+            }));
+        }
+    }
+
+    ~SourcePrefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    // waits until file `index` has been read; NULL if it can't be read
+    SourceContents take(size_t index)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this, index]() {
+            return m_slots[index].ready;
+        });
+        m_waitTime += std::chrono::steady_clock::now() - start;
+
+        SourceContents contents = std::move(m_slots[index].contents);
+        m_taken = index + 1;
+        m_cond.notify_all();
+        return contents;
+    }
+
+    // time spent in take() waiting for files to be read
+    std::chrono::steady_clock::duration waitTime() const
+    {
+        return m_waitTime;
+    }
+
+private:
+    struct Slot {
+        bool ready = false;
+        SourceContents contents;
+    };
+
+    void run()
+    {
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [this]() {
+                    return m_stop || m_next >= m_files.size() || m_next < m_taken + m_depth;
+                });
+                if (m_stop || m_next >= m_files.size()) {
+                    return;
+                }
+                index = m_next++;
+            }
+
+            SourceContents contents = readSourceFile(m_files[index].path);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_slots[index].contents = contents;
+                m_slots[index].ready = true;
+            }
+            m_cond.notify_all();
+        }
+    }
+
+    const std::vector<SourceFile>& m_files;
+    std::vector<Slot> m_slots;
+    const size_t m_depth;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::vector<std::thread> m_threads;
+    size_t m_next = 0;
+    size_t m_taken = 0;
+    bool m_stop = false;
+    std::chrono::steady_clock::duration m_waitTime = std::chrono::steady_clock::duration::zero();
+};
+#else
+// Without threads, a file is read when it is taken.
+class SourcePrefetcher
+{
+public:
+    SourcePrefetcher(const std::vector<SourceFile>& files, size_t, size_t)
+        : m_files(files)
+    {
+    }
+
+    // reads file `index`; NULL if it can't be read
+    SourceContents take(size_t index)
+    {
+        auto start = std::chrono::steady_clock::now();
+        SourceContents contents = readSourceFile(m_files[index].path);
+        m_waitTime += std::chrono::steady_clock::now() - start;
+        return contents;
+    }
+
+    // time spent in take() reading files
+    std::chrono::steady_clock::duration waitTime() const
+    {
+        return m_waitTime;
+    }
+
+private:
+    const std::vector<SourceFile>& m_files;
+    std::chrono::steady_clock::duration m_waitTime = std::chrono::steady_clock::duration::zero();
+};
+#endif
+
+/**
+ * @brief Add all files below a directory to the image.
+ * @return 0 success, otherwise error
+ *
+ * The whole tree is collected first, see listSourceFiles.
+ */
+int addFiles(ImageContext& ctx, const char* dirname)
+{
+    std::vector<SourceFile> files;
+    {
+        PhaseTimer timer(ctx.stats.traversal);
+        if (listSourceFiles(dirname, files) != 0) {
+            return 1;
+        }
+    }
+
+    // Read files ahead while SPIFFS writes the current one. Not used for
+    // manifest builds, which already share contents through the source
+    // cache, nor with --stable-placement, which places files in another
+    // order once all of them are known.
+    std::unique_ptr<SourcePrefetcher> prefetcher;
+    if (s_readahead > 0 && !ctx.sourceCache && !(s_directLayout && s_stablePlacement)) {
+        prefetcher.reset(new SourcePrefetcher(files, s_readahead, workerCount(s_readahead)));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Duration readBefore = ctx.stats.sourceRead;
+    Duration ioBefore = ctx.stats.imageIo;
+    int result = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        SourceFile& file = files[i];
+        if (prefetcher) {
+            ctx.prefetched = prefetcher->take(i);
+            ctx.prefetchedPath = file.path;
+        }
+
+        // Add File to image.
+        int res;
+        if (ctx.update) {
+            res = updateFile(ctx, &file.name[0], file.path.c_str());
+        } else {
+            if (!ctx.quiet) {
+                std::cout << file.name << std::endl;
+            }
+            res = addFile(ctx, &file.name[0], file.path.c_str());
+        }
+        ctx.prefetched.reset();
+        if (res != 0) {
+            std::cerr << "error adding file!" << std::endl;
+            if (s_debugLevel > 0) {
+                std::cout << std::endl;
+            }
+            result = 1;
+            break;
+        }
+    }
+
+    auto total = std::chrono::steady_clock::now() - start;
+    auto wait = prefetcher ? prefetcher->waitTime() : Duration::zero();
+    ctx.stats.write += total - wait - (ctx.stats.sourceRead - readBefore) - (ctx.stats.imageIo - ioBefore);
+    ctx.stats.sourceRead += wait;
+
+    if (s_debugLevel > 0) {
+        typedef std::chrono::milliseconds ms;
+        std::cout << "waiting for source files: " << std::chrono::duration_cast<ms>(wait).count() << " ms, "
+                  << "writing image: " << std::chrono::duration_cast<ms>(total - wait).count() << " ms" << std::endl;
+    }
+    return result;
+}
+
+// Capacity planning
+//
+// Page counts are computed from file sizes the same way the direct layout
+// engine places files: one object index header page per file, further
+// object index pages once the header's table is full, and one data page per
+// SPIFFS_DATA_PAGE_SIZE bytes. Images packed through SPIFFS hold the same
+// pages once written, although SPIFFS may need to garbage collect while
+// writing them.
+
+struct PagePlan {
+    size_t files = 0;
+    uint64_t bytes = 0;
+    u32_t dataPages = 0;
+    u32_t indexPages = 0;
+
+    u32_t pages() const
+    {
+        return dataPages + indexPages;
+    }
+};
+
+static void planFile(const LayoutGeometry& g, u32_t size, PagePlan& plan)
+{
+    u32_t dataPages = (size + g.dataPageSize - 1) / g.dataPageSize;
+    u32_t indexPages = 1;
+    if (dataPages > g.hdrIxLen) {
+        indexPages += (dataPages - g.hdrIxLen + g.ixLen - 1) / g.ixLen;
+    }
+    plan.files++;
+    plan.bytes += size;
+    plan.dataPages += dataPages;
+    plan.indexPages += indexPages;
+}
+
+// Number of blocks an image needs to hold `pages` pages, including the two
+// blocks SPIFFS keeps free
+static u32_t planBlocks(const LayoutGeometry& g, u32_t pages)
+{
+    return (pages + g.lookupEntries - 1) / g.lookupEntries + 2;
+}
+
+/**
+ * @brief Get sizes of the files which would be added to an image.
+ * @param dirName Source directory.
+ * @param sizes File sizes are appended here.
+ * @return 0 success, otherwise error
+ */
+static int planSourceFiles(const std::string& dirName, std::vector<u32_t>& sizes)
+{
+    std::vector<SourceFile> files;
+    if (listSourceFiles(dirName, files) != 0) {
+        return 1;
+    }
+
+    for (const SourceFile& file : files) {
+        if (file.name.size() > SPIFFS_OBJ_NAME_LEN - 1) {
+            std::cerr << "error: file name " << file.name << " is too long" << std::endl;
+            return 1;
+        }
+        sizes.push_back(file.size);
+    }
+    return 0;
+}
+
+/**
+ * @brief Find all objects of a mounted image in one pass over its lookup
+ * tables, filling ctx.objects and ctx.objectById.
+ *
+ * SPIFFS_readdir scans lookup tables for every entry it returns, and opening
+ * a file by name scans them again, while this visits each page once. Objects
+ * are listed in the same order as SPIFFS_readdir lists them.
+ */
+static void indexImage(ImageContext& ctx)
+{
+    const u32_t entries = SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(&ctx.fs);
+    const u8_t hdrFlagsMask = SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_IXDELE;
+    const u8_t hdrFlags = SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE;
+    const u8_t ixFlagsMask = SPIFFS_PH_FLAG_USED | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_DELET;
+
+    ctx.objects.clear();
+    ctx.objectById.clear();
+    for (spiffs_block_ix bix = 0; bix < ctx.fs.block_count; ++bix) {
+        if (!ctx.emptyBlocks.empty() && ctx.emptyBlocks[bix]) {
+            continue;
+        }
+        const u8_t* lu = flashRead(ctx, SPIFFS_BLOCK_TO_PADDR(&ctx.fs, bix), entries * sizeof(spiffs_obj_id));
+        for (u32_t e = lookupFindIndex(lu, 0, entries); e < entries; e = lookupFindIndex(lu, e + 1, entries)) {
+            spiffs_obj_id id;
+            memcpy(&id, lu + e * sizeof(id), sizeof(id));
+            spiffs_page_ix pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(&ctx.fs, bix, e);
+            spiffs_page_header ph;
+            memcpy(&ph, flashRead(ctx, SPIFFS_PAGE_TO_PADDR(&ctx.fs, pix), sizeof(ph)), sizeof(ph));
+            bool header = ph.span_ix == 0 && (ph.flags & hdrFlagsMask) == hdrFlags;
+            bool ixPage = ph.span_ix > 0 && (ph.flags & ixFlagsMask) == SPIFFS_PH_FLAG_DELET;
+            if (ph.obj_id != id || (!header && !ixPage)) {
+                continue;
+            }
+
+            auto found = ctx.objectById.insert(std::make_pair(id & ~SPIFFS_OBJ_ID_IX_FLAG, ctx.objects.size()));
+            if (found.second) {
+                ctx.objects.push_back(IndexedObject());
+            }
+            IndexedObject& obj = ctx.objects[found.first->second];
+            if (obj.ixPages.size() <= ph.span_ix) {
+                obj.ixPages.resize(ph.span_ix + 1, (spiffs_page_ix) ~0);
+            }
+            obj.ixPages[ph.span_ix] = pix;
+
+            if (header) {
+                spiffs_page_object_ix_header hdr;
+                memcpy(&hdr, flashRead(ctx, SPIFFS_PAGE_TO_PADDR(&ctx.fs, pix), sizeof(hdr)), sizeof(hdr));
+                obj.hasHeader = true;
+                obj.ent.obj_id = id & ~SPIFFS_OBJ_ID_IX_FLAG;
+                memcpy(obj.ent.name, hdr.name, SPIFFS_OBJ_NAME_LEN);
+                obj.ent.name[SPIFFS_OBJ_NAME_LEN - 1] = 0;
+                obj.ent.type = hdr.type;
+                obj.ent.size = (hdr.size == SPIFFS_UNDEFINED_LEN) ? 0 : hdr.size;
+                obj.ent.pix = pix;
+#if SPIFFS_OBJ_META_LEN
+                memcpy(obj.ent.meta, hdr.meta, SPIFFS_OBJ_META_LEN);
+#endif
+            }
+        }
+    }
+
+    // index pages without a header belong to objects being deleted
+    std::vector<IndexedObject> objects;
+    for (IndexedObject& obj : ctx.objects) {
+        if (obj.hasHeader) {
+            objects.push_back(std::move(obj));
+        }
+    }
+    std::sort(objects.begin(), objects.end(), [](const IndexedObject& a, const IndexedObject& b) {
+        return a.ent.pix < b.ent.pix;
+    });
+    ctx.objects.swap(objects);
+    ctx.objectById.clear();
+    for (size_t i = 0; i < ctx.objects.size(); ++i) {
+        ctx.objectById[ctx.objects[i].ent.obj_id] = i;
+    }
+}
+
+void listFiles(ImageContext& ctx)
+{
+    indexImage(ctx);
+    for (const IndexedObject& obj : ctx.objects) {
+        std::cout << obj.ent.size << '\t' << obj.ent.name << std::endl;
+    }
+}
+
+/**
+ * @brief Check if directory exists.
+ * @param path Directory path.
+ * @return True if exists otherwise false.
+ *
+ * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ */
+bool dirExists(const char* path)
+{
+    DIR *d = opendir(path);
+
+    if (d) {
+        closedir(d);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Create directory if it not exists.
+ * @param path Directory path.
+ * @return True or false.
+ *
+ * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ */
+bool dirCreate(const char* path)
+{
+    // Check if directory also exists.
+    if (dirExists(path)) {
+        return false;
+    }
+
+    // platform stuff...
+#if defined(_WIN32)
+    if (_mkdir(path) != 0) {
+#else
+    if (mkdir(path, S_IRWXU | S_IXGRP | S_IRGRP | S_IROTH | S_IXOTH) != 0) {
+#endif
+        std::cerr << "Can not create directory!!!" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Unpack file from file system.
+ * @param spiffsFile SPIFFS dir entry pointer.
+ * @param destPath Destination file path path.
+ * @return True or false.
+ *
+ * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ */
+bool unpackFile(ImageContext& ctx, spiffs_dirent *spiffsFile, const char *destPath)
+{
+    // Open file from spiffs file system; the header page is known, so
+    // there's no need to look the name up again.
+    spiffs_file src = SPIFFS_open_by_page(&ctx.fs, spiffsFile->pix, SPIFFS_RDONLY, 0);
+    if (src < 0) {
+        return false;
+    }
+
+    // Open file.
+    FILE* dst = fopen(destPath, "wb");
+    if (!dst) {
+        SPIFFS_close(&ctx.fs, src);
+        return false;
+    }
+
+    // Copy content through a buffer which is reused for all files. It holds as
+    // many whole data pages as the SPIFFS cache, so reads start at page
+    // boundaries and memory use doesn't depend on the file size.
+    const u32_t dataPageSize = SPIFFS_DATA_PAGE_SIZE(&ctx.fs);
+    ctx.unpackBuf.resize(std::max<size_t>(1, ctx.cache.size() / dataPageSize) * dataPageSize);
+
+    bool ok = true;
+    u32_t left = spiffsFile->size;
+    while (left > 0) {
+        s32_t chunk = (left < ctx.unpackBuf.size()) ? left : ctx.unpackBuf.size();
+        s32_t res = SPIFFS_read(&ctx.fs, src, &ctx.unpackBuf[0], chunk);
+        if (res <= 0 || fwrite(&ctx.unpackBuf[0], 1, res, dst) != (size_t) res) {
+            ok = false;
+            break;
+        }
+        left -= res;
+    }
+
+    // Close files.
+    fclose(dst);
+    SPIFFS_close(&ctx.fs, src);
+
+    return ok;
+}
+
+/**
+ * @brief Find data pages of a file by reading object index pages in place.
+ * @param spiffsFile SPIFFS dir entry pointer.
+ * @param dataPages Receives page indices of data pages, in span index order.
+ * @return True if all pages were found and are valid, otherwise false.
+ */
+bool resolveDataPages(ImageContext& ctx, const spiffs_dirent *spiffsFile, std::vector<spiffs_page_ix>& dataPages)
+{
+    const spiffs_obj_id objId = spiffsFile->obj_id & ~SPIFFS_OBJ_ID_IX_FLAG;
+    const u32_t pageSize = SPIFFS_CFG_LOG_PAGE_SZ(&ctx.fs);
+    const u32_t dataPageSize = SPIFFS_DATA_PAGE_SIZE(&ctx.fs);
+    const u32_t hdrIxLen = SPIFFS_OBJ_HDR_IX_LEN(&ctx.fs);
+    const u32_t ixLen = SPIFFS_OBJ_IX_LEN(&ctx.fs);
+    const u8_t ixFlagsMask = SPIFFS_PH_FLAG_USED | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_DELET;
+
+    u32_t dataPageCount = (spiffsFile->size + dataPageSize - 1) / dataPageSize;
+    u32_t ixPageCount = 1;
+    if (dataPageCount > hdrIxLen) {
+        ixPageCount += (dataPageCount - hdrIxLen + ixLen - 1) / ixLen;
+    }
+
+    // object index pages were found by indexImage
+    auto found = ctx.objectById.find(objId);
+    if (found == ctx.objectById.end()) {
+        return false;
+    }
+    std::vector<spiffs_page_ix> ixPages = ctx.objects[found->second].ixPages;
+    ixPages.resize(ixPageCount, (spiffs_page_ix) ~0);
+    ixPages[0] = spiffsFile->pix;
+
+    dataPages.clear();
+    for (u32_t span = 0; span < dataPageCount; ++span) {
+        spiffs_span_ix ixSpan = 0;
+        u32_t offset = sizeof(spiffs_page_object_ix_header) + span * sizeof(spiffs_page_ix);
+        if (span >= hdrIxLen) {
+            ixSpan = 1 + (span - hdrIxLen) / ixLen;
+            offset = sizeof(spiffs_page_object_ix) + (span - hdrIxLen) % ixLen * sizeof(spiffs_page_ix);
+        }
+        if (ixPages[ixSpan] == (spiffs_page_ix) ~0) {
+            return false;
+        }
+
+        spiffs_page_ix pix;
+        memcpy(&pix, flashRead(ctx, ixPages[ixSpan] * pageSize + offset, sizeof(pix)), sizeof(pix));
+        if (pix >= SPIFFS_MAX_PAGES(&ctx.fs)) {
+            return false;
+        }
+        const spiffs_page_header* ph = (const spiffs_page_header*) flashRead(ctx, SPIFFS_PAGE_TO_PADDR(&ctx.fs, pix), sizeof(spiffs_page_header));
+        if (ph->obj_id != objId || ph->span_ix != span ||
+                (ph->flags & ixFlagsMask) != (SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_DELET)) {
+            return false;
+        }
+        dataPages.push_back(pix);
+    }
+    return true;
+}
+
+/**
+ * @brief Write data pages of the image straight to a destination file.
+ * @param ctx Image context.
+ * @param destPath Destination file path.
+ * @param size File size.
+ * @param dataPages Data pages of the file, as returned by resolveDataPages.
+ * @return True or false.
+ *
+ * Only reads the image, so it can run on several threads at once.
+ */
+bool writeDataPages(ImageContext& ctx, const char *destPath, u32_t size, const std::vector<spiffs_page_ix>& dataPages)
+{
+    FILE* dst = fopen(destPath, "wb");
+    if (!dst) {
+        return false;
+    }
+
+    bool ok = true;
+    const u32_t dataPageSize = SPIFFS_DATA_PAGE_SIZE(&ctx.fs);
+    u32_t left = size;
+    for (spiffs_page_ix pix : dataPages) {
+        u32_t chunk = (left < dataPageSize) ? left : dataPageSize;
+        const u8_t* data = flashRead(ctx, SPIFFS_PAGE_TO_PADDR(&ctx.fs, pix) + sizeof(spiffs_page_header), chunk);
+        if (fwrite(data, 1, chunk, dst) != chunk) {
+            ok = false;
+            break;
+        }
+        left -= chunk;
+    }
+    fclose(dst);
+    return ok;
+}
+
+/**
+ * @brief Unpack file by writing data pages of the image straight to the destination file.
+ * @param spiffsFile SPIFFS dir entry pointer.
+ * @param destPath Destination file path path.
+ * @return True or false. If the object index can't be resolved, false is
+ * returned and nothing is written.
+ */
+bool unpackFileZeroCopy(ImageContext& ctx, spiffs_dirent *spiffsFile, const char *destPath)
+{
+    std::vector<spiffs_page_ix> dataPages;
+    if (!resolveDataPages(ctx, spiffsFile, dataPages)) {
+        return false;
+    }
+    return writeDataPages(ctx, destPath, spiffsFile->size, dataPages);
+}
+
+// File resolved by the directory walk, waiting for an unpack worker
+struct UnpackTask {
+    std::string destPath;
+    u32_t size;
+    std::vector<spiffs_page_ix> dataPages;
+};
+
+#if MKSPIFFS_THREADS
+class UnpackQueue
+{
+public:
+    void push(UnpackTask& task)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+        m_cond.notify_one();
+    }
+
+    // returns false once the queue is closed and empty
+    bool pop(UnpackTask& task)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() {
+            return m_closed || !m_tasks.empty();
+        });
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_cond.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<UnpackTask> m_tasks;
+    bool m_closed = false;
+};
+#endif
+
+/**
+ * @brief Unpack files from file system.
+ * @param sDest Directory path as std::string.
+ * @return True or false.
+ *
+ * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ *
+ * todo: Do unpack stuff for directories.
+ */
+bool unpackFiles(ImageContext& ctx, std::string sDest)
+{
+    // Add "./" to path if is not given.
+    if (sDest.find("./") == std::string::npos && sDest.find("/") == std::string::npos) {
+        sDest = "./" + sDest;
+    }
+
+    // Check if directory exists. If it does not then try to create it with permissions 755.
+    if (! dirExists(sDest.c_str())) {
+        std::cout << "Directory " << sDest << " does not exists. Try to create it." << std::endl;
+
+        // Try to create directory.
+        if (! dirCreate(sDest.c_str())) {
+            return false;
+        }
+    }
+
+#if MKSPIFFS_THREADS
+    // With -j, this thread walks the directory and resolves object indices,
+    // while worker threads copy data pages to the destination files.
+    UnpackQueue queue;
+    std::atomic<bool> workerError(false);
+    std::vector<std::thread> workers;
+    if (s_jobCountSet) {
+        for (size_t i = 0; i < workerCount(); ++i) {
+            workers.push_back(std::thread([&ctx, &queue, &workerError]() {
+                UnpackTask task;
+                while (queue.pop(task)) {
+                    if (!writeDataPages(ctx, task.destPath.c_str(), task.size, task.dataPages)) {
+                        std::cerr << "Can not write " << task.destPath << "!" << std::endl;
+                        workerError = true;
+                    }
+                }
+            }));
+        }
+    }
+#endif
+
+    // Read content from directory.
+    indexImage(ctx);
+    bool ok = true;
+    for (IndexedObject& obj : ctx.objects) {
+        spiffs_dirent* it = &obj.ent;
+
+        // Check if content is a file.
+        if ((int)(it->type) == 1) {
+            std::string name = (const char*)(it->name);
+            std::string sDestFilePath = sDest + name;
+            size_t pos = name.find_first_of("/", 1);
+
+            // If file is in sub directories?
+            while (ok && pos != std::string::npos) {
+                // Subdir path.
+                std::string path = sDest;
+                path += name.substr(0, pos);
+
+                // Create subddir if subdir not exists.
+                if (!dirExists(path.c_str())) {
+                    ok = dirCreate(path.c_str());
+                }
+
+                pos = name.find_first_of("/", pos + 1);
+            }
+            if (!ok) {
+                break;
+            }
+
+            // Unpack file to destination directory. Zero-copy unpacking
+            // falls back to reading through SPIFFS if the index looks odd.
+            bool unpacked = false;
+#if MKSPIFFS_THREADS
+            if (!workers.empty()) {
+                UnpackTask task;
+                if (resolveDataPages(ctx, it, task.dataPages)) {
+                    task.destPath = sDestFilePath;
+                    task.size = it->size;
+                    queue.push(task);
+                    unpacked = true;
+                }
+            } else
+#endif
+            if (s_zeroCopy) {
+                unpacked = unpackFileZeroCopy(ctx, it, sDestFilePath.c_str());
+            }
+            if (!unpacked && !unpackFile(ctx, it, sDestFilePath.c_str())) {
+                std::cout << "Can not unpack " << it->name << "!" << std::endl;
+                ok = false;
+                break;
+            }
 
             // Output stuff.
             std::cout
@@ -445,183 +2439,1183 @@ bool unpackFiles(std::string sDest)
                     << "size: " << it->size << " Bytes"
                     << std::endl;
         }
+    }
+
+#if MKSPIFFS_THREADS
+    // Wait for workers to write remaining files.
+    queue.close();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return ok && !workerError;
+#else
+    return ok;
+#endif
+}
+
+/**
+ * @brief Fill bytes of object index pages which SPIFFS leaves unset.
+ *
+ * SPIFFS writes index page headers from structures on the stack, including
+ * alignment bytes which are never initialised, so two images built from the
+ * same files could differ in those bytes. They are not read by SPIFFS, and
+ * are set to the erased value here.
+ *
+ * Pages are found by their header rather than by their lookup entry: when
+ * SPIFFS moves an index page, the old copy keeps its contents but its lookup
+ * entry is cleared, and it still holds the unset bytes.
+ */
+static void scrubIndexPages(ImageContext& ctx)
+{
+    const LayoutGeometry g = layoutGeometry(ctx);
+    const u32_t packedHeaderSize = objIxHeaderSize(ctx.profile->metaLen, false);
+
+    for (u32_t bix = 0; bix < g.blockCount; ++bix) {
+        for (u32_t entry = 0; entry < g.lookupEntries; ++entry) {
+            u32_t addr = (bix * g.pagesPerBlock + g.lookupPages + entry) * g.pageSize;
+            spiffs_page_header ph;
+            memcpy(&ph, ctx.flashmem.data() + addr, sizeof(ph));
+            if (ph.flags & SPIFFS_PH_FLAG_INDEX) {
+                continue;
+            }
+
+            u8_t* page = ctx.flashmem.writeData() + addr;
+            memset(page + sizeof(spiffs_page_header), 0xff, sizeof(spiffs_page_object_ix) - sizeof(spiffs_page_header));
+            if (ph.span_ix == 0) {
+                memset(page + packedHeaderSize, 0xff, g.ixHeaderSize - packedHeaderSize);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Make the image contents depend on the source files only, and
+ * compute its digest into ctx.digest.
+ */
+static void finishReproducibleImage(ImageContext& ctx)
+{
+    scrubIndexPages(ctx);
+
+    Sha256 sha;
+    sha.update(ctx.flashmem.data(), ctx.flashmem.size());
+    ctx.digest = sha.hexDigest();
+}
+
+// Actions
+
+/**
+ * @brief Pack with --stream: lay out files directly, and write each block
+ * to the image file as soon as the files in it are complete.
+ * @return 0 success, otherwise error
+ *
+ * Only the blocks spanned by the file being placed are held in memory. The
+ * image is mapped back from the file to verify it.
+ */
+static int actionPackStream(ImageContext& ctx)
+{
+    ctx.streamFile = fopen(ctx.imageName.c_str(), "wb");
+    if (!ctx.streamFile) {
+        std::cerr << "error: failed to open image file" << std::endl;
+        return 1;
+    }
+
+    layoutBegin(ctx);
+    ctx.streamBlocks.clear();
+    ctx.streamFlushed = 0;
+    ctx.streamSha = Sha256();
+    int result = addFiles(ctx, ctx.dirName.c_str());
+    if (!layoutFlush(ctx, ctx.geometry.blockCount)) {
+        std::cerr << "error: failed to write image file" << std::endl;
+        result = 1;
+    }
+    if (fclose(ctx.streamFile) != 0) {
+        result = 1;
+    }
+    ctx.streamFile = NULL;
+
+    if (result == 0 && loadImage(ctx, ctx.imageName) == 0) {
+        if (!layoutVerify(ctx)) {
+            result = 1;
+        }
+        ctx.flashmem.release();
+    }
+
+    if (result == 0 && s_reproducible) {
+        ctx.digest = ctx.streamSha.hexDigest();
+        if (!ctx.quiet) {
+            std::cout << ctx.digest << "  " << ctx.imageName << std::endl;
+        }
+    }
+    return result;
+}
+
+int actionPack(ImageContext& ctx)
+{
+    if (!dirExists(ctx.dirName.c_str())) {
+        std::cerr << "error: can't read source directory" << std::endl;
+        return 1;
+    }
+
+    if (ctx.imageSize == 0) {
+        ctx.imageSize = 0x10000;
+        if (s_debugLevel > 0) {
+            std::cout << "image size not specifed, using default: " << ctx.imageSize << std::endl;
+        }
+    }
+
+    int err = checkArgs(ctx);
+    if (err != 0) {
+        return err;
+    }
+
+    if (s_stream) {
+        return actionPackStream(ctx);
+    }
+
+    ctx.flashmem.create(ctx.imageSize);
+
+    FILE* fdres = fopen(ctx.imageName.c_str(), "wb");
+    if (!fdres) {
+        std::cerr << "error: failed to open image file" << std::endl;
+        return 1;
+    }
+
+    int result;
+    if (s_directLayout) {
+        // SPIFFS is only used to check the result
+        layoutBegin(ctx);
+        result = addFiles(ctx, ctx.dirName.c_str());
+        if (result == 0 && s_stablePlacement) {
+            auto start = std::chrono::steady_clock::now();
+            Duration readBefore = ctx.stats.sourceRead;
+            result = layoutPlaceSources(ctx);
+            ctx.stats.write += std::chrono::steady_clock::now() - start - (ctx.stats.sourceRead - readBefore);
+        }
+        if (result == 0 && !layoutVerify(ctx)) {
+            result = 1;
+        }
+    } else {
+        spiffsFormat(ctx);
+        result = addFiles(ctx, ctx.dirName.c_str());
+        spiffsUnmount(ctx);
+    }
+
+    if (s_reproducible) {
+        finishReproducibleImage(ctx);
+    }
+
+    {
+        PhaseTimer timer(ctx.stats.imageIo);
+        fwrite(ctx.flashmem.data(), 4, ctx.flashmem.size() / 4, fdres);
+        fclose(fdres);
+    }
+
+    // same format as sha256sum
+    if (result == 0 && s_reproducible && !ctx.quiet) {
+        std::cout << ctx.digest << "  " << ctx.imageName << std::endl;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Pack with --auto-size: create the smallest image which holds the
+ * files plus --free-margin bytes.
+ * @return 0 success, otherwise error
+ *
+ * The size comes from the capacity planner. Images packed through SPIFFS
+ * can occasionally need one more block than planned, when garbage
+ * collection can't free pages early enough, so a second build with one
+ * more block is attempted if the first one fails.
+ */
+int actionAutoSize(ImageContext& ctx)
+{
+    std::vector<u32_t> sizes;
+    if (planSourceFiles(ctx.dirName, sizes) != 0) {
+        return 1;
+    }
+
+    const LayoutGeometry g = layoutGeometry(ctx);
+    PagePlan plan;
+    for (u32_t size : sizes) {
+        planFile(g, size, plan);
+    }
+    u32_t marginPages = ((u32_t) s_freeMargin + g.dataPageSize - 1) / g.dataPageSize;
+    u32_t blocks = planBlocks(g, plan.pages() + marginPages);
+
+    int result = 1;
+    for (int attempt = 0; attempt < 2 && result != 0; ++attempt, ++blocks) {
+        ctx.imageSize = blocks * g.blockSize;
+        if (attempt > 0) {
+            std::cerr << "retrying with image size " << ctx.imageSize << std::endl;
+            // only the build which succeeds is reported by --stats etc.
+            ctx.stats = Stats();
+            ctx.wear = WearStats();
+            ctx.norViolations = 0;
+        }
+
+        // Output of the first build, such as the names of the files added,
+        // is held back until it succeeds, so it isn't printed twice.
+        std::ostringstream held;
+        std::streambuf* out = (attempt == 0) ? std::cout.rdbuf(held.rdbuf()) : NULL;
+        result = actionPack(ctx);
+        if (out) {
+            std::cout.rdbuf(out);
+            if (result == 0) {
+                std::cout << held.str();
+            }
+        }
+    }
+
+    if (result == 0 && !ctx.quiet) {
+        std::cout << "image size: " << ctx.imageSize << std::endl;
+    }
+    return result;
+}
+
+static size_t getFileSize(FILE* fp)
+{
+    fseek(fp, 0L, SEEK_END);
+    size_t size = (size_t) ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    return size;
+}
+
+/**
+ * @brief Open an image file and map (or read) it into ctx.flashmem.
+ * @param fileName Image file, ctx.imageName unless updating an image.
+ * @return 0 success, otherwise error
+ */
+static int loadImage(ImageContext& ctx, const std::string& fileName)
+{
+    FILE* fdsrc = fopen(fileName.c_str(), "rb");
+    if (!fdsrc) {
+        std::cerr << "error: failed to open image file" << std::endl;
+        return 1;
+    }
+
+    if (ctx.imageSize == 0) {
+        ctx.imageSize = getFileSize(fdsrc);
+    }
+
+    int err = checkArgs(ctx);
+    if (err != 0) {
+        fclose(fdsrc);
+        return err;
+    }
+
+    // the mapping, if any, stays valid after the file is closed
+    PhaseTimer timer(ctx.stats.imageIo);
+    ctx.flashmem.load(fdsrc, ctx.imageSize);
+    fclose(fdsrc);
+    scanEmptyBlocks(ctx);
+    return 0;
+}
+
+/**
+ * @brief Update action: bring an existing image in line with the source
+ * directory.
+ * @return 0 success, otherwise error
+ *
+ * Only files which were added, changed or removed are written, so pages of
+ * unchanged files keep their place and contents, unless SPIFFS has to
+ * garbage collect to make room.
+ */
+int actionUpdate(ImageContext& ctx)
+{
+    if (!dirExists(ctx.dirName.c_str())) {
+        std::cerr << "error: can't read source directory" << std::endl;
+        return 1;
+    }
+
+    int err = loadImage(ctx, s_updateImageName);
+    if (err != 0) {
+        return err;
+    }
+
+    if (!spiffsMount(ctx)) {
+        return 1;
+    }
+
+    indexImage(ctx);
+    for (const IndexedObject& obj : ctx.objects) {
+        ctx.updateFiles[(const char*) obj.ent.name] = obj.ent.size;
+    }
+
+    ctx.update = true;
+    int result = addFiles(ctx, ctx.dirName.c_str());
+
+    // whatever is left was not found in the source directory
+    size_t removed = 0;
+    for (auto& file : ctx.updateFiles) {
+        if (result != 0) {
+            break;
+        }
+        if (!ctx.quiet) {
+            std::cout << file.first << " (removed)" << std::endl;
+        }
+        if (SPIFFS_remove(&ctx.fs, (char*) file.first.c_str()) != SPIFFS_OK) {
+            std::cerr << "error: failed to remove " << file.first << std::endl;
+            result = 1;
+        }
+        removed++;
+    }
+    spiffsUnmount(ctx);
+
+    if (result != 0) {
+        return result;
+    }
+
+    if (s_debugLevel > 0) {
+        std::cout << "unchanged files: " << ctx.updateUnchanged << ", removed files: " << removed << std::endl;
+    }
+
+    if (s_reproducible) {
+        finishReproducibleImage(ctx);
+    }
+
+    // The existing image may still be mapped, and may be the output file, so
+    // write to a temporary file and move it into place.
+    std::string tmpName = ctx.imageName + ".tmp";
+    FILE* fdres = fopen(tmpName.c_str(), "wb");
+    if (!fdres) {
+        std::cerr << "error: failed to open image file" << std::endl;
+        return 1;
+    }
+    bool ok;
+    {
+        PhaseTimer timer(ctx.stats.imageIo);
+        ok = fwrite(ctx.flashmem.data(), 1, ctx.flashmem.size(), fdres) == ctx.flashmem.size();
+        ok = (fclose(fdres) == 0) && ok;
+    }
+    ctx.flashmem.release();
+#if defined(_WIN32)
+    remove(ctx.imageName.c_str());
+#endif
+    if (!ok || rename(tmpName.c_str(), ctx.imageName.c_str()) != 0) {
+        std::cerr << "error: failed to write image file" << std::endl;
+        remove(tmpName.c_str());
+        return 1;
+    }
+
+    if (s_reproducible && !ctx.quiet) {
+        std::cout << ctx.digest << "  " << ctx.imageName << std::endl;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Print how many flash erase blocks of the new image differ from a
+ * previous version of it, which is roughly what a delta update has to
+ * rewrite on the device.
+ * @return 0 success, otherwise error
+ */
+int reportBlockChanges(const ImageContext& ctx, const std::string& previousName)
+{
+    FlashMemory images[2];
+    const std::string* names[2] = { &previousName, &ctx.imageName };
+    for (int i = 0; i < 2; ++i) {
+        FILE* fp = fopen(names[i]->c_str(), "rb");
+        if (!fp) {
+            std::cerr << "error: failed to open " << *names[i] << std::endl;
+            return 1;
+        }
+        images[i].load(fp, getFileSize(fp));
+        fclose(fp);
+    }
+
+    const size_t blockSize = physicalFlashEraseBlockSize;
+    size_t blockCount = (images[1].size() + blockSize - 1) / blockSize;
+    size_t changed = 0;
+    for (size_t offset = 0; offset < images[1].size(); offset += blockSize) {
+        size_t len = std::min(blockSize, images[1].size() - offset);
+        if (offset + len > images[0].size() ||
+                memcmp(images[0].data() + offset, images[1].data() + offset, len) != 0) {
+            ++changed;
+        }
+    }
+
+    std::cout << "blocks changed: " << changed << " of " << blockCount
+              << " (" << blockSize << " bytes each)" << std::endl;
+    return 0;
+}
+
+/**
+ * @brief Unpack action.
+ * @return 0 success, 1 error
+ *
+ * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ */
+int actionUnpack(ImageContext& ctx)
+{
+    int ret = 0;
+
+    // map or read spiffs image into s_flashmem
+    int err = loadImage(ctx, ctx.imageName);
+    if (err != 0) {
+        return err;
+    }
+
+    // mount file system
+    if (!spiffsMount(ctx)) {
+        std::cerr << "error: failed to mount image" << std::endl;
+        return 1;
+    }
+
+    // unpack files
+    if (! unpackFiles(ctx, ctx.dirName)) {
+        ret = 1;
+    }
+
+    // unmount file system
+    spiffsUnmount(ctx);
+
+    return ret;
+}
+
+
+/**
+ * @brief Plan action: print how many pages the files of a directory need,
+ * and whether they fit into an image of the given size.
+ * @return 0 if the files fit (or no image size was given), otherwise 1
+ */
+int actionPlan(ImageContext& ctx)
+{
+    int err = checkArgs(ctx);
+    if (err != 0) {
+        return err;
+    }
+
+    std::vector<u32_t> sizes;
+    if (planSourceFiles(ctx.dirName, sizes) != 0) {
+        return 1;
+    }
+
+    const LayoutGeometry g = layoutGeometry(ctx);
+    PagePlan plan;
+    for (u32_t size : sizes) {
+        planFile(g, size, plan);
+    }
+    u32_t minBlocks = planBlocks(g, plan.pages());
+
+    std::cout << "files: " << plan.files << " (" << plan.bytes << " bytes)" << std::endl;
+    std::cout << "data pages: " << plan.dataPages << std::endl;
+    std::cout << "index pages: " << plan.indexPages << std::endl;
+    std::cout << "lookup pages: " << g.lookupPages << " per block, " << g.lookupPages * minBlocks << " in the smallest image" << std::endl;
+    std::cout << "minimum image size: " << minBlocks * g.blockSize << " bytes (" << minBlocks << " blocks)" << std::endl;
+
+    if (ctx.imageSize == 0) {
+        return 0;
+    }
+
+    // pages available for files, leaving two free blocks
+    u32_t capacity = (g.blockCount > 2) ? (g.blockCount - 2) * g.lookupEntries : 0;
+    if (plan.pages() > capacity) {
+        std::cout << "does not fit into " << ctx.imageSize << " bytes: "
+                  << plan.pages() - capacity << " pages short" << std::endl;
+        return 1;
+    }
+    u32_t headroom = capacity - plan.pages();
+    std::cout << "headroom: " << headroom << " pages (" << (uint64_t) headroom * g.dataPageSize
+              << " bytes of file data, less " << g.pageSize << " bytes per new file)" << std::endl;
+    return 0;
+}
+
+// Result of planning the source files for one page and block size
+struct GeometryPlan {
+    LayoutGeometry geometry;
+    PagePlan plan;
+    u32_t blocks;
+    uint64_t tailBytes;
+    uint64_t overheadBytes;
+    uint64_t readBytes;
+};
+
+static GeometryPlan planGeometry(const LayoutGeometry& g, const std::vector<u32_t>& sizes)
+{
+    GeometryPlan result;
+    result.geometry = g;
+    for (u32_t size : sizes) {
+        planFile(g, size, result.plan);
+    }
+    const PagePlan& plan = result.plan;
+    result.blocks = planBlocks(g, plan.pages());
+
+    // unused bytes at the end of the last data page of each file
+    result.tailBytes = (uint64_t) plan.dataPages * g.dataPageSize - plan.bytes;
+    // page headers, object index pages and lookup pages
+    result.overheadBytes = (uint64_t) plan.dataPages * sizeof(spiffs_page_header) +
+                           (uint64_t) plan.indexPages * g.pageSize +
+                           (uint64_t) result.blocks * g.lookupPages * g.pageSize;
+
+    // Rough cost of opening and reading every file once on the device:
+    // finding a file by name scans the lookup pages and, on average, half of
+    // the object index headers, then the index and data pages are read.
+    uint64_t openBytes = (uint64_t) result.blocks * g.lookupPages * g.pageSize +
+                         (uint64_t) plan.files * g.ixHeaderSize / 2;
+    result.readBytes = plan.files * openBytes + (uint64_t) plan.indexPages * g.pageSize +
+                       (uint64_t) plan.dataPages * g.pageSize;
+    return result;
+}
+
+/**
+ * @brief Optimize geometry action: plan the files of a directory for each
+ * page and block size SPIFFS accepts, and print the results, smallest
+ * image first.
+ * @return 0 success, otherwise error
+ */
+int actionOptimizeGeometry(ImageContext& ctx)
+{
+    std::vector<u32_t> sizes;
+    if (planSourceFiles(ctx.dirName, sizes) != 0) {
+        return 1;
+    }
+
+    // block sizes are multiples of the flash erase block size, see checkArgs
+    std::vector<LayoutGeometry> candidates;
+    for (u32_t blockSize = physicalFlashEraseBlockSize; blockSize <= 65536; blockSize += physicalFlashEraseBlockSize) {
+        for (u32_t pageSize = 128; pageSize < blockSize; pageSize *= 2) {
+            if (blockSize % pageSize != 0) {
+                continue;
+            }
+            LayoutGeometry g = layoutGeometry(pageSize, blockSize, 0, ctx.profile);
+            if (g.ixHeaderSize >= g.pageSize || g.lookupPages >= g.pagesPerBlock) {
+                continue;
+            }
+            candidates.push_back(g);
+        }
+    }
+
+    std::vector<GeometryPlan> results(candidates.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t j = next++; j < candidates.size(); j = next++) {
+            results[j] = planGeometry(candidates[j], sizes);
+        }
+    };
+#if MKSPIFFS_THREADS
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workerCount(candidates.size()); ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+#else
+    worker();
+#endif
+
+    // pages are numbered with spiffs_page_ix, so SPIFFS can't address images
+    // with more pages than that holds
+    results.erase(std::remove_if(results.begin(), results.end(), [](const GeometryPlan& result) {
+        return (uint64_t) result.blocks * result.geometry.pagesPerBlock > (spiffs_page_ix) -1;
+    }), results.end());
+
+    std::sort(results.begin(), results.end(), [](const GeometryPlan& a, const GeometryPlan& b) {
+        uint64_t aSize = (uint64_t) a.blocks * a.geometry.blockSize;
+        uint64_t bSize = (uint64_t) b.blocks * b.geometry.blockSize;
+        return (aSize != bSize) ? aSize < bSize : a.readBytes < b.readBytes;
+    });
+
+    std::cout << std::setw(6) << "page" << std::setw(7) << "block"
+              << std::setw(12) << "image size" << std::setw(12) << "tail waste"
+              << std::setw(12) << "overhead" << std::setw(14) << "est. reads" << std::endl;
+    for (const GeometryPlan& result : results) {
+        const LayoutGeometry& g = result.geometry;
+        std::cout << std::setw(6) << g.pageSize << std::setw(7) << g.blockSize
+                  << std::setw(12) << (uint64_t) result.blocks * g.blockSize
+                  << std::setw(12) << result.tailBytes
+                  << std::setw(12) << result.overheadBytes
+                  << std::setw(14) << result.readBytes << std::endl;
+    }
+    return 0;
+}
+
+int actionList(ImageContext& ctx)
+{
+    int err = loadImage(ctx, ctx.imageName);
+    if (err != 0) {
+        return err;
+    }
+
+    if (!spiffsMount(ctx)) {
+        std::cerr << "error: failed to mount image" << std::endl;
+        return 1;
+    }
+
+    listFiles(ctx);
+    spiffsUnmount(ctx);
+    return 0;
+}
+
+int actionVisualize(ImageContext& ctx)
+{
+    int err = loadImage(ctx, ctx.imageName);
+    if (err != 0) {
+        return err;
+    }
 
-        // Get next file handle.
-        it = SPIFFS_readdir(&dir, &ent);
-    } // end while
+    if (!spiffsMount(ctx)) {
+        std::cerr << "error: failed to mount image" << std::endl;
+        return 1;
+    }
 
-    // Close directory.
-    SPIFFS_closedir(&dir);
+    SPIFFS_vis(&ctx.fs);
+    uint32_t total, used;
+    SPIFFS_info(&ctx.fs, &total, &used);
+    std::cout << "total: " << total <<  std::endl << "used: " << used << std::endl;
+    spiffsUnmount(ctx);
 
-    return true;
+    return 0;
 }
 
-// Actions
+// Workload replay
+//
+// A trace describes file operations an application would make at runtime.
+// They are run through the SPIFFS API against a loaded image, and their cost
+// is measured in HAL operations, garbage collection runs and block erases,
+// together with how the pages of the image are used after each trace line.
+
+// One line of a trace, run `count` times
+struct TraceStep {
+    int lineNumber = 0;
+    std::string op;
+    std::string name;
+    std::string newName;
+    u32_t size = 0;
+    u32_t count = 1;
+};
 
-int actionPack()
+// Cost of all calls of one kind of operation
+struct ReplayCost {
+    uint64_t calls = 0;
+    uint64_t failed = 0;
+    uint64_t halOps = 0;
+    uint64_t maxHalOps = 0;
+    double flashUs = 0;
+    double maxFlashUs = 0;
+};
+
+/**
+ * @brief Read a workload trace.
+ * @param fileName Trace file name.
+ * @param steps Receives the trace lines.
+ * @return True or false.
+ *
+ * Every line which is not empty and doesn't start with '#' is one of:
+ *   write <name> <size> [<count>]
+ *   append <name> <size> [<count>]
+ *   read <name> [<count>]
+ *   open <name> [<count>]
+ *   remove <name> [<count>]
+ *   rename <name> <new_name> [<count>]
+ * A "%d" in a name is replaced by the number of the repetition, from 0.
+ */
+static bool parseTrace(const std::string& fileName, std::vector<TraceStep>& steps)
 {
-    if (!dirExists(s_dirName.c_str())) {
-        std::cerr << "error: can't read source directory" << std::endl;
-        return 1;
+    std::ifstream trace(fileName.c_str());
+    if (!trace) {
+        std::cerr << "error: failed to open trace file" << std::endl;
+        return false;
     }
 
-    if (s_imageSize == 0) {
-        s_imageSize = 0x10000;
-        if (s_debugLevel > 0) {
-            std::cout << "image size not specifed, using default: " << s_imageSize << std::endl;
+    std::string line;
+    for (int lineNumber = 1; std::getline(trace, line); ++lineNumber) {
+        std::istringstream fields(line);
+        TraceStep step;
+        step.lineNumber = lineNumber;
+        if (!(fields >> step.op) || step.op[0] == '#') {
+            continue;
+        }
+
+        bool hasSize = step.op == "write" || step.op == "append";
+        bool valid = hasSize || step.op == "read" || step.op == "open" ||
+                     step.op == "remove" || step.op == "rename";
+        valid = valid && fields >> step.name;
+        if (valid && step.op == "rename") {
+            valid = static_cast<bool>(fields >> step.newName);
+        }
+        if (valid && hasSize) {
+            valid = static_cast<bool>(fields >> step.size);
+        }
+        std::string rest;
+        if (valid && fields >> step.count) {
+            valid = step.count > 0 && !(fields >> rest);
+        } else if (valid) {
+            valid = fields.eof();
+        }
+        if (!valid) {
+            std::cerr << "error: " << fileName << ":" << lineNumber << ": invalid trace line" << std::endl;
+            return false;
         }
+        steps.push_back(step);
     }
+    return true;
+}
 
-    int err = checkArgs();
-    if (err != 0) {
-        return err;
+static std::string traceName(const std::string& pattern, u32_t repetition)
+{
+    std::string name = pattern;
+    size_t pos = name.find("%d");
+    if (pos != std::string::npos) {
+        name.replace(pos, 2, std::to_string(repetition));
     }
+    return name;
+}
 
-    s_flashmem.resize(s_imageSize, 0xff);
+static uint64_t halOpCount(const ImageContext& ctx)
+{
+    return ctx.stats.halReads + ctx.stats.halWrites + ctx.stats.halErases;
+}
 
-    FILE* fdres = fopen(s_imageName.c_str(), "wb");
-    if (!fdres) {
-        std::cerr << "error: failed to open image file" << std::endl;
-        return 1;
+static uint64_t gcRunCount(const ImageContext& ctx)
+{
+#if SPIFFS_GC_STATS
+    return ctx.fs.stats_gc_runs;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Run one repetition of a trace line through the SPIFFS API.
+ * @return SPIFFS_OK or a SPIFFS error code.
+ */
+static s32_t replayStep(ImageContext& ctx, const TraceStep& step, u32_t repetition, std::vector<u8_t>& buf)
+{
+    std::string name = traceName(step.name, repetition);
+    char* path = (char*) name.c_str();
+    if (step.op == "remove") {
+        return SPIFFS_remove(&ctx.fs, path);
+    }
+    if (step.op == "rename") {
+        std::string newName = traceName(step.newName, repetition);
+        return SPIFFS_rename(&ctx.fs, path, (char*) newName.c_str());
     }
 
-    spiffsFormat();
-    int result = addFiles(s_dirName.c_str(), "/");
-    spiffsUnmount();
+    spiffs_flags flags = SPIFFS_RDONLY;
+    if (step.op == "write") {
+        flags = SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR;
+    } else if (step.op == "append") {
+        flags = SPIFFS_CREAT | SPIFFS_APPEND | SPIFFS_RDWR;
+    }
+    spiffs_file fd = SPIFFS_open(&ctx.fs, path, flags, 0);
+    if (fd < 0) {
+        return fd;
+    }
 
-    fwrite(&s_flashmem[0], 4, s_flashmem.size() / 4, fdres);
-    fclose(fdres);
+    s32_t res = SPIFFS_OK;
+    if (step.op == "read") {
+        while ((res = SPIFFS_read(&ctx.fs, fd, &buf[0], buf.size())) == (s32_t) buf.size()) {
+        }
+        if (res >= 0 || res == SPIFFS_ERR_END_OF_OBJECT) {
+            res = SPIFFS_OK;
+        }
+    } else if (flags != SPIFFS_RDONLY) {
+        for (u32_t left = step.size; left > 0 && res >= 0;) {
+            u32_t chunk = std::min<u32_t>(left, buf.size());
+            res = SPIFFS_write(&ctx.fs, fd, &buf[0], chunk);
+            left -= chunk;
+        }
+        res = std::min<s32_t>(res, SPIFFS_OK);
+    }
 
-    return result;
+    s32_t closeRes = SPIFFS_close(&ctx.fs, fd);
+    return (res != SPIFFS_OK) ? res : closeRes;
 }
 
-static size_t getFileSize(FILE* fp)
+/**
+ * @brief Count used, deleted and free pages from the lookup tables.
+ */
+static void replayPageUsage(ImageContext& ctx, u32_t& used, u32_t& deleted, u32_t& free)
 {
-    fseek(fp, 0L, SEEK_END);
-    size_t size = (size_t) ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-    return size;
+    const LayoutGeometry g = layoutGeometry(ctx);
+    used = deleted = free = 0;
+    for (u32_t bix = 0; bix < g.blockCount; ++bix) {
+        const u8_t* lu = flashRead(ctx, bix * g.blockSize, g.lookupEntries * sizeof(spiffs_obj_id));
+        for (u32_t e = 0; e < g.lookupEntries; ++e) {
+            spiffs_obj_id id;
+            memcpy(&id, lu + e * sizeof(id), sizeof(id));
+            if (id == SPIFFS_OBJ_ID_FREE) {
+                free++;
+            } else if (id == SPIFFS_OBJ_ID_DELETED) {
+                deleted++;
+            } else {
+                used++;
+            }
+        }
+    }
 }
 
 /**
- * @brief Unpack action.
- * @return 0 success, 1 error
+ * @brief Replay action: run a workload trace against an image and report
+ * the cost of each trace line and of each kind of operation.
+ * @return 0 success, otherwise error
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * The image file itself is left unchanged. Failed operations, e.g. writes
+ * to a full file system, are counted rather than stopping the replay.
  */
-int actionUnpack(void)
+int actionReplay(ImageContext& ctx)
 {
-    int ret = 0;
-
-    // open spiffs image
-    FILE* fdsrc = fopen(s_imageName.c_str(), "rb");
-    if (!fdsrc) {
-        std::cerr << "error: failed to open image file" << std::endl;
+    std::vector<TraceStep> steps;
+    if (!parseTrace(s_traceName, steps)) {
         return 1;
     }
 
-    if (s_imageSize == 0) {
-        s_imageSize = getFileSize(fdsrc);
-    }
-
-    int err = checkArgs();
+    int err = loadImage(ctx, ctx.imageName);
     if (err != 0) {
         return err;
     }
 
-    s_flashmem.resize(s_imageSize, 0xff);
-
-    // read content into s_flashmem
-    fread(&s_flashmem[0], 4, s_flashmem.size() / 4, fdsrc);
-
-    // close file handle
-    fclose(fdsrc);
-
-    // mount file system
-    if (!spiffsMount()) {
+    if (!spiffsMount(ctx)) {
         std::cerr << "error: failed to mount image" << std::endl;
         return 1;
     }
 
-    // unpack files
-    if (! unpackFiles(s_dirName)) {
-        ret = 1;
+    std::vector<u8_t> buf(s_chunkSize);
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = (u8_t)(i * 7 + 1);
     }
 
-    // unmount file system
-    spiffsUnmount();
-
-    return ret;
-}
-
-
-int actionList()
-{
-    FILE* fdsrc = fopen(s_imageName.c_str(), "rb");
-    if (!fdsrc) {
-        std::cerr << "error: failed to open image file" << std::endl;
-        return 1;
+    // deleted pages are only reclaimed by garbage collection, so their share
+    // of the pages not in use shows how fragmented the image has become
+    std::cout << std::setw(6) << "line" << std::setw(8) << "op" << std::setw(8) << "calls"
+              << std::setw(8) << "failed" << std::setw(10) << "hal ops" << std::setw(8) << "erases"
+              << std::setw(8) << "gc runs" << std::setw(8) << "used" << std::setw(9) << "deleted"
+              << std::setw(8) << "free" << std::setw(7) << "frag";
+    if (s_flashTiming) {
+        std::cout << std::setw(10) << "est. ms";
     }
+    std::cout << std::endl;
+
+    std::map<std::string, ReplayCost> costs;
+    for (const TraceStep& step : steps) {
+        ReplayCost& cost = costs[step.op];
+        uint64_t halBefore = halOpCount(ctx);
+        uint64_t erasesBefore = ctx.stats.halErases;
+        uint64_t gcBefore = gcRunCount(ctx);
+        double flashBefore = flashTimeUs(ctx.stats);
+        u32_t failed = 0;
+        s32_t firstError = SPIFFS_OK;
+        for (u32_t i = 0; i < step.count; ++i) {
+            uint64_t callBefore = halOpCount(ctx);
+            double callFlashBefore = flashTimeUs(ctx.stats);
+            s32_t res = replayStep(ctx, step, i, buf);
+            uint64_t callOps = halOpCount(ctx) - callBefore;
+            double callFlashUs = flashTimeUs(ctx.stats) - callFlashBefore;
+            cost.calls++;
+            cost.halOps += callOps;
+            cost.maxHalOps = std::max(cost.maxHalOps, callOps);
+            cost.flashUs += callFlashUs;
+            cost.maxFlashUs = std::max(cost.maxFlashUs, callFlashUs);
+            if (res != SPIFFS_OK) {
+                cost.failed++;
+                if (failed++ == 0) {
+                    firstError = res;
+                }
+            }
+        }
+        if (failed > 0) {
+            std::cerr << s_traceName << ":" << step.lineNumber << ": " << failed << " of " << step.count
+                      << " operations failed, first with SPIFFS error " << firstError << std::endl;
+        }
 
-    if (s_imageSize == 0) {
-        s_imageSize = getFileSize(fdsrc);
+        u32_t used, deleted, free;
+        replayPageUsage(ctx, used, deleted, free);
+        double frag = (deleted + free > 0) ? (double) deleted / (deleted + free) : 0;
+        std::cout << std::setw(6) << step.lineNumber << std::setw(8) << step.op << std::setw(8) << step.count
+                  << std::setw(8) << failed << std::setw(10) << halOpCount(ctx) - halBefore
+                  << std::setw(8) << ctx.stats.halErases - erasesBefore
+                  << std::setw(8) << gcRunCount(ctx) - gcBefore << std::setw(8) << used
+                  << std::setw(9) << deleted << std::setw(8) << free
+                  << std::setw(7) << std::fixed << std::setprecision(2) << frag;
+        if (s_flashTiming) {
+            std::cout << std::setw(10) << std::setprecision(1) << (flashTimeUs(ctx.stats) - flashBefore) / 1000;
+        }
+        std::cout << std::endl;
     }
 
-    int err = checkArgs();
-    if (err != 0) {
-        return err;
+    std::cout << std::endl << std::setw(8) << "op" << std::setw(8) << "calls" << std::setw(8) << "failed"
+              << std::setw(14) << "hal ops/call" << std::setw(8) << "max";
+    if (s_flashTiming) {
+        std::cout << std::setw(13) << "est. ms/call" << std::setw(9) << "max ms";
+    }
+    std::cout << std::endl;
+    for (const auto& entry : costs) {
+        const ReplayCost& cost = entry.second;
+        std::cout << std::setw(8) << entry.first << std::setw(8) << cost.calls << std::setw(8) << cost.failed
+                  << std::setw(14) << std::fixed << std::setprecision(1) << (double) cost.halOps / cost.calls
+                  << std::setw(8) << cost.maxHalOps;
+        if (s_flashTiming) {
+            std::cout << std::setw(13) << std::setprecision(2) << cost.flashUs / 1000 / cost.calls
+                      << std::setw(9) << cost.maxFlashUs / 1000;
+        }
+        std::cout << std::endl;
     }
 
-    s_flashmem.resize(s_imageSize, 0xff);
+    spiffsUnmount(ctx);
+    return 0;
+}
 
-    fread(&s_flashmem[0], 4, s_flashmem.size() / 4, fdsrc);
-    fclose(fdsrc);
+/**
+ * @brief Read manifest file describing the images to build.
+ * @param fileName Manifest file name.
+ * @param jobs Receives one context per image.
+ * @return True or false.
+ *
+ * Every line which is not empty and doesn't start with '#' describes one image:
+ *   <pack_dir> <image_file> [-s <number>] [-p <number>] [-b <number>]
+ * Sizes which are not given default to the ones given on the command line.
+ */
+static bool parseManifest(const std::string& fileName, std::vector<std::unique_ptr<ImageContext>>& jobs)
+{
+    std::ifstream manifest(fileName.c_str());
+    if (!manifest) {
+        std::cerr << "error: failed to open manifest file" << std::endl;
+        return false;
+    }
 
-    if (!spiffsMount()) {
-        std::cerr << "error: failed to mount image" << std::endl;
-        return 1;
+    std::string line;
+    for (int lineNumber = 1; std::getline(manifest, line); ++lineNumber) {
+        std::istringstream fields(line);
+        std::unique_ptr<ImageContext> job(new ImageContext);
+        if (!(fields >> job->dirName) || job->dirName[0] == '#') {
+            continue;
+        }
+        job->imageSize = s_imageSize;
+        job->pageSize = s_pageSize;
+        job->blockSize = s_blockSize;
+        job->profile = s_formatProfile;
+
+        bool valid = static_cast<bool>(fields >> job->imageName);
+        std::string option, value;
+        while (valid && fields >> option) {
+            char* end = NULL;
+            valid = static_cast<bool>(fields >> value);
+            long number = strtol(value.c_str(), &end, 0);
+            valid = valid && *end == 0;
+            if (option == "-s") {
+                job->imageSize = number;
+            } else if (option == "-p") {
+                job->pageSize = number;
+            } else if (option == "-b") {
+                job->blockSize = number;
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            std::cerr << "error: " << fileName << ":" << lineNumber << ": invalid manifest line" << std::endl;
+            return false;
+        }
+        jobs.push_back(std::move(job));
     }
+    return true;
+}
 
-    listFiles();
-    spiffsUnmount();
-    return 0;
+/**
+ * @brief Report writes which --strict-nor could not apply.
+ * @return 0 if there were none, otherwise 1
+ */
+static int checkNorViolations(const ImageContext& ctx)
+{
+    if (ctx.norViolations == 0) {
+        return 0;
+    }
+    std::cerr << "error: " << ctx.imageName << ": " << ctx.norViolations
+              << " flash writes needed bits to change from 0 to 1, first at 0x"
+              << std::hex << ctx.firstNorViolation << std::dec << std::endl;
+    return 1;
 }
 
-int actionVisualize()
+/**
+ * @brief Manifest action: build several images in parallel.
+ * @return 0 success, 1 if any of the images failed
+ */
+int actionManifest()
 {
-    FILE* fdsrc = fopen(s_imageName.c_str(), "rb");
-    if (!fdsrc) {
-        std::cerr << "error: failed to open image file" << std::endl;
+    std::vector<std::unique_ptr<ImageContext>> jobs;
+    if (!parseManifest(s_manifestName, jobs)) {
         return 1;
     }
 
-    if (s_imageSize == 0) {
-        s_imageSize = getFileSize(fdsrc);
+    // images built from the same directory share source file contents
+    SourceCache sourceCache;
+    for (auto& job : jobs) {
+        job->sourceCache = &sourceCache;
+        job->quiet = true;
     }
 
-    int err = checkArgs();
-    if (err != 0) {
-        return err;
+    std::vector<int> results(jobs.size(), 1);
+    std::atomic<size_t> nextJob(0);
+#if MKSPIFFS_THREADS
+    std::mutex outputMutex;
+#endif
+    auto worker = [&]() {
+        for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) {
+            results[i] = actionPack(*jobs[i]);
+            if (results[i] == 0) {
+                results[i] = checkNorViolations(*jobs[i]);
+            }
+
+#if MKSPIFFS_THREADS
+            std::lock_guard<std::mutex> lock(outputMutex);
+#endif
+            if (results[i] == 0 && s_reproducible) {
+                std::cout << jobs[i]->digest << "  ";
+            }
+            std::cout << jobs[i]->imageName << (results[i] == 0 ? "" : ": failed") << std::endl;
+        }
+    };
+
+#if MKSPIFFS_THREADS
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workerCount(jobs.size()); ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    for (auto& thread : threads) {
+        thread.join();
     }
+#else
+    worker();
+#endif
 
-    s_flashmem.resize(s_imageSize, 0xff);
+    for (int result : results) {
+        if (result != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
+/**
+ * @brief Print the timings and counters collected while running an action,
+ * as text or as a single line of JSON.
+ */
+static void printStats(const ImageContext& ctx, const std::string& format)
+{
+    typedef std::chrono::duration<double, std::milli> ms;
+    const Stats& st = ctx.stats;
+    const std::pair<const char*, Duration> phases[] = {
+        {"traversal", st.traversal},
+        {"source_read", st.sourceRead},
+        {"write", st.write},
+        {"format", st.format},
+        {"mount", st.mount},
+        {"image_io", st.imageIo},
+    };
+    const struct {
+        const char* name;
+        uint64_t calls;
+        uint64_t bytes;
+    } hal[] = {
+        {"read", st.halReads, st.halReadBytes},
+        {"write", st.halWrites, st.halWriteBytes},
+        {"erase", st.halErases, st.halEraseBytes},
+    };
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    if (format == "json") {
+        out << "{\"times_ms\":{";
+        for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+            out << (i ? "," : "") << "\"" << phases[i].first << "\":" << ms(phases[i].second).count();
+        }
+        out << "},\"hal\":{";
+        for (size_t i = 0; i < sizeof(hal) / sizeof(hal[0]); ++i) {
+            out << (i ? "," : "") << "\"" << hal[i].name << "\":{\"calls\":" << hal[i].calls
+                << ",\"bytes\":" << hal[i].bytes << "}";
+        }
+        out << "},\"cache\":{\"hits\":" << st.cacheHits << ",\"misses\":" << st.cacheMisses << "}"
+            << ",\"gc_runs\":" << st.gcRuns;
+        if (s_flashTiming) {
+            out << ",\"flash_ms\":{\"read\":" << st.flashReadUs / 1000 << ",\"program\":" << st.flashProgramUs / 1000
+                << ",\"erase\":" << st.flashEraseUs / 1000 << ",\"mount\":" << st.flashMountUs / 1000 << "}";
+        }
+        out << "}";
+    } else {
+        for (const auto& phase : phases) {
+            out << phase.first << ": " << ms(phase.second).count() << " ms" << std::endl;
+        }
+        for (const auto& op : hal) {
+            out << "hal " << op.name << ": " << op.calls << " calls, " << op.bytes << " bytes" << std::endl;
+        }
+        out << "cache: " << st.cacheHits << " hits, " << st.cacheMisses << " misses" << std::endl;
+        out << "gc runs: " << st.gcRuns;
+    }
+    std::cout << out.str() << std::endl;
+}
 
-    fread(&s_flashmem[0], 4, s_flashmem.size() / 4, fdsrc);
-    fclose(fdsrc);
+/**
+ * @brief Print how long the flash operations of the action would take on a
+ * device, with --flash-timing.
+ */
+static void printFlashTiming(const ImageContext& ctx)
+{
+    const Stats& st = ctx.stats;
+    std::cout << std::fixed << std::setprecision(1)
+              << "estimated flash time (" << s_flashTiming->name << "): read " << st.flashReadUs / 1000
+              << " ms, program " << st.flashProgramUs / 1000 << " ms, erase " << st.flashEraseUs / 1000
+              << " ms, total " << flashTimeUs(st) / 1000 << " ms" << std::endl;
+    std::cout << "estimated mount time: " << st.flashMountUs / 1000 << " ms" << std::endl;
+}
 
-    if (!spiffsMount()) {
-        std::cerr << "error: failed to mount image" << std::endl;
-        return 1;
+/**
+ * @brief Print the erase and program counts collected with --wear, overall
+ * and for each block which was erased or programmed.
+ */
+static void printWear(const ImageContext& ctx)
+{
+    const WearStats& w = ctx.wear;
+    if (w.pagePrograms.empty()) {
+        std::cout << "wear: no flash writes or erases" << std::endl;
+        return;
     }
 
-    SPIFFS_vis(&s_fs);
-    uint32_t total, used;
-    SPIFFS_info(&s_fs, &total, &used);
-    std::cout << "total: " << total <<  std::endl << "used: " << used << std::endl;
-    spiffsUnmount();
+    const u32_t pagesPerBlock = ctx.blockSize / ctx.pageSize;
+    uint64_t erases = 0, programs = 0;
+    u32_t erasedBlocks = 0, programmedPages = 0;
+    size_t maxBlock = 0, maxPage = 0;
+    for (size_t bix = 0; bix < w.blockErases.size(); ++bix) {
+        erases += w.blockErases[bix];
+        erasedBlocks += (w.blockErases[bix] > 0);
+        if (w.blockErases[bix] > w.blockErases[maxBlock]) {
+            maxBlock = bix;
+        }
+    }
+    for (size_t page = 0; page < w.pagePrograms.size(); ++page) {
+        programs += w.pagePrograms[page];
+        programmedPages += (w.pagePrograms[page] > 0);
+        if (w.pagePrograms[page] > w.pagePrograms[maxPage]) {
+            maxPage = page;
+        }
+    }
 
-    return 0;
+    std::cout << "block erases: " << erases << ", " << erasedBlocks << " of " << w.blockErases.size()
+              << " blocks erased, at most " << w.blockErases[maxBlock] << " (block " << maxBlock << ")" << std::endl;
+    std::cout << "page programs: " << programs << ", " << programmedPages << " of " << w.pagePrograms.size()
+              << " pages programmed, at most " << w.pagePrograms[maxPage] << " (page " << maxPage << ")" << std::endl;
+    std::cout << "writes setting bits from 0 to 1: " << w.illegalWrites;
+    if (w.illegalWrites > 0) {
+        std::cout << " (" << w.illegalBits << " bits, first at 0x" << std::hex << w.firstIllegalAddr << std::dec << ")";
+    }
+    std::cout << std::endl;
+
+    std::cout << "block\terases\tprograms\tmost programs of a page" << std::endl;
+    for (size_t bix = 0; bix < w.blockErases.size(); ++bix) {
+        uint64_t blockPrograms = 0;
+        u32_t pageMax = 0;
+        for (size_t page = bix * pagesPerBlock; page < (bix + 1) * pagesPerBlock; ++page) {
+            blockPrograms += w.pagePrograms[page];
+            pageMax = std::max(pageMax, w.pagePrograms[page]);
+        }
+        if (w.blockErases[bix] == 0 && blockPrograms == 0) {
+            continue;
+        }
+        std::cout << bix << "\t" << w.blockErases[bix] << "\t" << blockPrograms << "\t" << pageMax << std::endl;
+    }
 }
 
 #define PRINT_INT_MACRO(def_name) \
@@ -649,6 +3643,11 @@ public:
         PRINT_INT_MACRO(SPIFFS_USE_MAGIC_LENGTH);
 #endif
         PRINT_INT_MACRO(SPIFFS_ALIGNED_OBJECT_INDEX_TABLES);
+        std::cout << "Format profiles for --direct-layout:";
+        for (const FormatProfile& profile : s_formatProfiles) {
+            std::cout << " " << profile.name;
+        }
+        std::cout << std::endl;
     }
 };
 
@@ -664,19 +3663,71 @@ void processArgs(int argc, const char** argv)
     TCLAP::ValueArg<std::string> unpackArg( "u", "unpack", "unpack spiffs image to a directory", true, "", "dest_dir");
     TCLAP::SwitchArg listArg( "l", "list", "list files in spiffs image", false);
     TCLAP::SwitchArg visualizeArg( "i", "visualize", "visualize spiffs image", false);
-    TCLAP::UnlabeledValueArg<std::string> outNameArg( "image_file", "spiffs image file", true, "", "image_file"  );
+    TCLAP::ValueArg<std::string> updateArg( "", "update", "with -c, start from an existing image and only write files which were added, changed or removed", false, "", "existing_image");
+    TCLAP::SwitchArg streamArg( "", "stream", "with --direct-layout, write blocks to the image file as soon as they are complete instead of keeping the whole image in memory", false);
+    TCLAP::SwitchArg stablePlacementArg( "", "stable-placement", "with --direct-layout, place each file at a block and object id derived from its name, so that changes to a few files leave most blocks of the image unchanged", false);
+    TCLAP::ValueArg<int> blockSlackArg( "", "block-slack", "with --stable-placement, number of pages kept free in each block until all blocks are full, to absorb files which grow", false, 0, "pages" );
+    TCLAP::SwitchArg reproducibleArg( "", "reproducible", "when creating an image, make sure identical source files give an identical image, and print its SHA-256", false);
+    TCLAP::ValueArg<std::string> compareArg( "", "compare", "when creating an image, print how many flash erase blocks differ from a previous image", false, "", "previous_image");
+    TCLAP::ValueArg<std::string> planArg( "", "plan", "print how many pages the files of a directory need, and whether they fit into an image of the given size", true, "", "pack_dir");
+    TCLAP::ValueArg<std::string> optimizeGeometryArg( "", "optimize-geometry", "print image size and overhead for the files of a directory with each page and block size, smallest image first", true, "", "pack_dir");
+    TCLAP::ValueArg<std::string> replayArg( "", "replay", "run the file operations listed in a trace file against an image, and print their cost in flash operations and how the pages of the image are used after each line; the image file is not changed", true, "", "trace_file");
+    TCLAP::ValueArg<std::string> manifestArg( "", "manifest", "create spiffs images listed in a manifest file, one '<pack_dir> <image_file> [-s <number>] [-p <number>] [-b <number>]' per line", true, "", "manifest_file");
+    TCLAP::UnlabeledValueArg<std::string> outNameArg( "image_file", "spiffs image file", false, "", "image_file"  );
     TCLAP::ValueArg<int> imageSizeArg( "s", "size", "fs image size, in bytes", false, 0, "number" );
     TCLAP::ValueArg<int> pageSizeArg( "p", "page", "fs page size, in bytes", false, 256, "number" );
     TCLAP::ValueArg<int> blockSizeArg( "b", "block", "fs block size, in bytes", false, 4096, "number" );
     TCLAP::SwitchArg addAllFilesArg( "a", "all-files", "when creating an image, include files which are normally ignored; currently only applies to '.DS_Store' files and '.git' directories", false);
     TCLAP::ValueArg<int> debugArg( "d", "debug", "Debug level. 0 means no debug output.", false, 0, "0-5" );
+    TCLAP::SwitchArg directLayoutArg( "", "direct-layout", "when creating an image, place pages directly into the image instead of writing files through SPIFFS; the image is mounted afterwards to verify it", false);
+    TCLAP::SwitchArg zeroCopyArg( "", "zero-copy", "when unpacking, write file data straight from the image instead of reading it through SPIFFS", false);
+    TCLAP::ValueArg<int> jobsArg( "j", "jobs", "number of images created in parallel with --manifest, of threads writing files when unpacking, or at most of threads reading files ahead when creating an image; 0 means one per CPU", false, 0, "number" );
+    std::vector<std::string> profileNames;
+    for (const FormatProfile& profile : s_formatProfiles) {
+        profileNames.push_back(profile.name);
+    }
+    TCLAP::ValuesConstraint<std::string> profileConstraint(profileNames);
+    TCLAP::ValueArg<std::string> formatProfileArg( "", "format-profile", "with --direct-layout, create the image for a SPIFFS configuration other than the one mkspiffs was built with", false, "", &profileConstraint );
+    TCLAP::SwitchArg autoSizeArg( "", "auto-size", "when creating an image, use the smallest image size which holds the files; -s is not used", false);
+    TCLAP::ValueArg<int> freeMarginArg( "", "free-margin", "with --auto-size, number of bytes of file data which should still fit into the image", false, 0, "number" );
+    TCLAP::ValueArg<int> readaheadArg( "", "readahead", "when creating an image, number of source files read ahead on separate threads while the current one is written; 0 disables reading ahead", false, 4, "files" );
+    std::vector<std::string> statsFormats = {"text", "json"};
+    TCLAP::ValuesConstraint<std::string> statsConstraint(statsFormats);
+    TCLAP::ValueArg<std::string> statsArg( "", "stats", "print time spent in each phase and counts of flash reads, writes and erases once the action is done", false, "", &statsConstraint );
+    TCLAP::SwitchArg wearArg( "", "wear", "count erases of each flash block and programs of each page made through SPIFFS, and writes which would need to change bits from 0 to 1, and print them once the action is done", false);
+    TCLAP::SwitchArg strictNorArg( "", "strict-nor", "apply SPIFFS writes the way NOR flash does, only clearing bits, and fail if a write needed bits to change from 0 to 1", false);
+    std::string timingNames;
+    for (const FlashTiming& timing : s_flashTimings) {
+        timingNames += timing.name;
+        timingNames += "|";
+    }
+    TCLAP::ValueArg<std::string> flashTimingArg( "", "flash-timing", "estimate how long flash reads, programs and erases made through SPIFFS would take on a device, using the timings of a flash part, or ones given as <read_ns_per_byte>,<program_us_per_page>,<erase_ms_per_sector>", false, "", timingNames + "ns,us,ms" );
+    TCLAP::ValueArg<int> chunkSizeArg( "", "chunk-size", "when creating an image, size of the chunks in which files are written, in bytes", false, 4096, "number" );
 
     cmd.add( imageSizeArg );
     cmd.add( pageSizeArg );
     cmd.add( blockSizeArg );
     cmd.add( addAllFilesArg );
     cmd.add( debugArg );
-    std::vector<TCLAP::Arg*> args = {&packArg, &unpackArg, &listArg, &visualizeArg};
+    cmd.add( chunkSizeArg );
+    cmd.add( statsArg );
+    cmd.add( wearArg );
+    cmd.add( strictNorArg );
+    cmd.add( flashTimingArg );
+    cmd.add( readaheadArg );
+    cmd.add( freeMarginArg );
+    cmd.add( autoSizeArg );
+    cmd.add( directLayoutArg );
+    cmd.add( stablePlacementArg );
+    cmd.add( streamArg );
+    cmd.add( blockSlackArg );
+    cmd.add( formatProfileArg );
+    cmd.add( zeroCopyArg );
+    cmd.add( jobsArg );
+    cmd.add( updateArg );
+    cmd.add( compareArg );
+    cmd.add( reproducibleArg );
+    std::vector<TCLAP::Arg*> args = {&packArg, &unpackArg, &listArg, &visualizeArg, &manifestArg, &planArg, &optimizeGeometryArg, &replayArg};
     cmd.xorAdd( args );
     cmd.add( outNameArg );
     cmd.parse( argc, argv );
@@ -696,6 +3747,18 @@ void processArgs(int argc, const char** argv)
         s_action = ACTION_LIST;
     } else if (visualizeArg.isSet()) {
         s_action = ACTION_VISUALIZE;
+    } else if (manifestArg.isSet()) {
+        s_manifestName = manifestArg.getValue();
+        s_action = ACTION_MANIFEST;
+    } else if (planArg.isSet()) {
+        s_dirName = planArg.getValue();
+        s_action = ACTION_PLAN;
+    } else if (optimizeGeometryArg.isSet()) {
+        s_dirName = optimizeGeometryArg.getValue();
+        s_action = ACTION_OPTIMIZE_GEOMETRY;
+    } else if (replayArg.isSet()) {
+        s_traceName = replayArg.getValue();
+        s_action = ACTION_REPLAY;
     }
 
     s_imageName = outNameArg.getValue();
@@ -703,37 +3766,143 @@ void processArgs(int argc, const char** argv)
     s_pageSize  = pageSizeArg.getValue();
     s_blockSize = blockSizeArg.getValue();
     s_addAllFiles = addAllFilesArg.isSet();
+    s_chunkSize = chunkSizeArg.getValue();
+    s_readahead = readaheadArg.getValue();
+    s_autoSize = autoSizeArg.isSet();
+    s_freeMargin = freeMarginArg.getValue();
+    s_directLayout = directLayoutArg.isSet();
+    s_stablePlacement = stablePlacementArg.isSet();
+    s_stream = streamArg.isSet();
+    s_blockSlack = blockSlackArg.getValue();
+    s_compareImageName = compareArg.getValue();
+    s_zeroCopy = zeroCopyArg.isSet();
+    s_reproducible = reproducibleArg.isSet();
+    s_jobCount = jobsArg.getValue();
+    s_jobCountSet = jobsArg.isSet();
+    s_updateImageName = updateArg.getValue();
+    s_statsFormat = statsArg.getValue();
+    s_wear = wearArg.isSet();
+    s_strictNor = strictNorArg.isSet();
+
+    if (flashTimingArg.isSet()) {
+        for (const FlashTiming& timing : s_flashTimings) {
+            if (flashTimingArg.getValue() == timing.name) {
+                s_flashTiming = &timing;
+            }
+        }
+        FlashTiming& custom = s_customFlashTiming;
+        char end;
+        if (!s_flashTiming && sscanf(flashTimingArg.getValue().c_str(), "%lf,%lf,%lf%c", &custom.readNsPerByte,
+                                     &custom.programUsPerPage, &custom.eraseMsPerSector, &end) == 3 &&
+                custom.readNsPerByte >= 0 && custom.programUsPerPage >= 0 && custom.eraseMsPerSector >= 0) {
+            s_flashTiming = &custom;
+        }
+        if (!s_flashTiming) {
+            std::cerr << "error: unknown flash timing " << flashTimingArg.getValue() << std::endl;
+            throw TCLAP::ArgParseException("invalid value", flashTimingArg.toString());
+        }
+    }
+
+    for (const FormatProfile& profile : s_formatProfiles) {
+        if (formatProfileArg.getValue() != profile.name) {
+            continue;
+        }
+        // a profile which matches the built-in configuration is treated as
+        // the built-in one, so images can still be verified after creation
+        bool builtin = profile.metaLen == s_builtinProfile.metaLen &&
+                       profile.useMagic == s_builtinProfile.useMagic &&
+                       profile.useMagicLength == s_builtinProfile.useMagicLength &&
+                       profile.alignedObjectIndexTables == s_builtinProfile.alignedObjectIndexTables;
+        s_formatProfile = builtin ? &s_builtinProfile : &profile;
+    }
 }
 
-static int checkArgs()
+static int checkArgs(const ImageContext& ctx)
 {
     // Argument checks don't use TCLAP's Constraint interface because
     // a) we need to check one argument against another, while Constraints only check
     // each argument individually, and b) image size might only be known when image
     // file is opened.
 
-    if (s_imageSize < 0 || s_pageSize < 0 || s_blockSize < 0) {
+    if (ctx.imageSize < 0 || ctx.pageSize < 0 || ctx.blockSize < 0) {
         std::cerr << "error: Image, block, page sizes should not be negative" << std::endl;
         return 1;
     }
 
-    if (s_imageSize % s_blockSize != 0) {
+    if (ctx.profile != &s_builtinProfile &&
+            !(s_directLayout && (s_action == ACTION_PACK || s_action == ACTION_MANIFEST)) &&
+            s_action != ACTION_PLAN && s_action != ACTION_OPTIMIZE_GEOMETRY) {
+        std::cerr << "error: Format profile " << ctx.profile->name << " can only be used to create images with --direct-layout" << std::endl;
+        return 1;
+    }
+
+    if (!s_updateImageName.empty() && (s_action != ACTION_PACK || s_directLayout)) {
+        std::cerr << "error: --update can only be used with -c, without --direct-layout" << std::endl;
+        return 1;
+    }
+
+    if (s_stablePlacement && !(s_directLayout && (s_action == ACTION_PACK || s_action == ACTION_MANIFEST))) {
+        std::cerr << "error: --stable-placement can only be used to create images with --direct-layout" << std::endl;
+        return 1;
+    }
+
+    if (s_reproducible && s_action != ACTION_PACK && s_action != ACTION_MANIFEST) {
+        std::cerr << "error: --reproducible can only be used when creating images" << std::endl;
+        return 1;
+    }
+
+    if (s_stream && (!s_directLayout || s_stablePlacement || !s_updateImageName.empty() ||
+                     (s_action != ACTION_PACK && s_action != ACTION_MANIFEST))) {
+        std::cerr << "error: --stream can only be used to create images with --direct-layout, without --stable-placement or --update" << std::endl;
+        return 1;
+    }
+
+    if (!s_compareImageName.empty() && s_action != ACTION_PACK) {
+        std::cerr << "error: --compare can only be used with -c" << std::endl;
+        return 1;
+    }
+
+    if (s_autoSize && (s_action != ACTION_PACK || !s_updateImageName.empty())) {
+        std::cerr << "error: --auto-size can only be used with -c, without --update" << std::endl;
+        return 1;
+    }
+
+    if (s_freeMargin < 0) {
+        std::cerr << "error: Free margin should not be negative" << std::endl;
+        return 1;
+    }
+
+    if (s_readahead < 0) {
+        std::cerr << "error: Readahead should not be negative" << std::endl;
+        return 1;
+    }
+
+    if (s_chunkSize <= 0) {
+        std::cerr << "error: Chunk size should be positive" << std::endl;
+        return 1;
+    }
+
+    if (ctx.imageSize % ctx.blockSize != 0) {
         std::cerr << "error: Image size should be a multiple of block size" << std::endl;
         return 1;
     }
 
-    if (s_blockSize % s_pageSize != 0) {
+    if (ctx.blockSize % ctx.pageSize != 0) {
         std::cerr << "error: Block size should be a multiple of page size" << std::endl;
         return 1;
     }
 
-    const int physicalFlashEraseBlockSize = 4096;
-    if (s_blockSize % physicalFlashEraseBlockSize != 0) {
+    if (ctx.blockSize % physicalFlashEraseBlockSize != 0) {
         std::cerr << "error: Block size should be multiple of flash erase block size (" <<
                      physicalFlashEraseBlockSize << ")" << std::endl;
         return 1;
     }
 
+    if (s_blockSlack < 0 || (u32_t) s_blockSlack >= layoutGeometry(ctx).lookupEntries) {
+        std::cerr << "error: Block slack should be less than the number of pages per block" << std::endl;
+        return 1;
+    }
+
     return 0;
 }
 
@@ -747,22 +3916,84 @@ int main(int argc, const char * argv[])
         return 1;
     }
 
+    if (s_action == ACTION_MANIFEST) {
+        if (!s_statsFormat.empty() || s_wear || s_flashTiming) {
+            std::cerr << "error: --stats, --wear and --flash-timing can't be used with --manifest" << std::endl;
+            return 1;
+        }
+        return actionManifest();
+    }
+
+    if (s_imageName.empty() && s_action != ACTION_PLAN && s_action != ACTION_OPTIMIZE_GEOMETRY) {
+        std::cerr << "error: image_file is required" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<ImageContext> ctx(new ImageContext);
+    ctx->dirName = s_dirName;
+    ctx->imageName = s_imageName;
+    ctx->imageSize = s_imageSize;
+    ctx->pageSize = s_pageSize;
+    ctx->blockSize = s_blockSize;
+    ctx->profile = s_formatProfile;
+
+    int result = 1;
     switch (s_action) {
     case ACTION_PACK:
-        return actionPack();
+        if (s_autoSize) {
+            result = checkArgs(*ctx);
+            if (result == 0) {
+                result = actionAutoSize(*ctx);
+            }
+        } else {
+            result = s_updateImageName.empty() ? actionPack(*ctx) : actionUpdate(*ctx);
+        }
+        if (result == 0 && !s_compareImageName.empty()) {
+            result = reportBlockChanges(*ctx, s_compareImageName);
+        }
         break;
     case ACTION_UNPACK:
-        return actionUnpack();
+        result = actionUnpack(*ctx);
         break;
     case ACTION_LIST:
-        return actionList();
+        result = actionList(*ctx);
         break;
     case ACTION_VISUALIZE:
-        return actionVisualize();
+        result = actionVisualize(*ctx);
+        break;
+    case ACTION_PLAN:
+        result = actionPlan(*ctx);
+        break;
+    case ACTION_OPTIMIZE_GEOMETRY:
+        result = actionOptimizeGeometry(*ctx);
+        break;
+    case ACTION_REPLAY:
+        result = actionReplay(*ctx);
         break;
     default:
         break;
     }
 
-    return 1;
+    if (s_debugLevel > 0) {
+        std::cout << "bytes copied by SPIFFS reads: " << ctx->readCopyBytes << std::endl;
+        std::cout << "bytes read without copying: " << ctx->readZeroCopyBytes << std::endl;
+    }
+
+    if (s_flashTiming) {
+        printFlashTiming(*ctx);
+    }
+
+    if (!s_statsFormat.empty()) {
+        printStats(*ctx, s_statsFormat);
+    }
+
+    if (s_wear) {
+        printWear(*ctx);
+    }
+
+    if (result == 0) {
+        result = checkNorViolations(*ctx);
+    }
+
+    return result;
 }
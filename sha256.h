@@ -0,0 +1,33 @@
+//
+//  sha256.h
+//  make_spiffs
+//
+//  SHA-256 (FIPS 180-4), used to print a digest of the created image.
+//
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const void* data, size_t len);
+
+    /** @brief Finish hashing and return the digest as lowercase hex. */
+    std::string hexDigest();
+
+private:
+    void transform(const uint8_t* block);
+
+    uint32_t m_state[8];
+    uint8_t m_block[64];
+    size_t m_blockLen;
+    uint64_t m_totalLen;
+};
+
+#endif // SHA256_H